@@ -3,31 +3,33 @@
 #define MAX_CHANNEL_COUNT 2
 #define FRAME_SIZE 240
 
+// Must be a power of 2
 #define CIRCULAR_BUFFER_SIZE 32
+#define CIRCULAR_BUFFER_MASK (CIRCULAR_BUFFER_SIZE - 1)
 
-// This code uses volatiles for synchronization between the producer and consumer side. This is
-// only safe because this code executes under very specific conditions, namely that the framework
-// ensures AudioPlayerSampleCallback and AudDecDecodeAndPlaySample are each only active on one thread
-// at a time.
+// This is a single-producer single-consumer ring. The framework ensures AudioPlayerSampleCallback
+// and AudDecDecodeAndPlaySample are each only active on one thread at a time, so each index has
+// exactly one writer. Each side publishes its own index with a release store and reads the other
+// side's with an acquire load, which orders the sample data without any locks or full barriers.
+// The indexes run freely and are masked on use, so a full ring is distinguishable from an empty one.
 
 static short s_CircularBuffer[CIRCULAR_BUFFER_SIZE][FRAME_SIZE * MAX_CHANNEL_COUNT];
-static int s_ReadIndex = 0;
-static int s_WriteIndex = 0;
+static unsigned int s_ReadIndex = 0;
+static unsigned int s_WriteIndex = 0;
 
 static void AudioPlayerSampleCallback(void* samples, uint32_t buffer_size, void* data) {
     // It should only ask us for complete buffers
     assert(buffer_size == FRAME_SIZE * MAX_CHANNEL_COUNT * sizeof(short));
         
-    // If the indexes aren't equal, we have a sample
-    if (s_WriteIndex != s_ReadIndex) {
-        memcpy(samples, s_CircularBuffer[s_ReadIndex], buffer_size);
-        
-        // Use a full memory barrier to ensure the circular buffer is read before incrementing the index
-        __sync_synchronize();
+    unsigned int readIndex = __atomic_load_n(&s_ReadIndex, __ATOMIC_RELAXED);
+    
+    // If the indexes aren't equal, we have a sample. The acquire pairs with the
+    // producer's release so the sample data is visible before we copy it.
+    if (__atomic_load_n(&s_WriteIndex, __ATOMIC_ACQUIRE) != readIndex) {
+        memcpy(samples, s_CircularBuffer[readIndex & CIRCULAR_BUFFER_MASK], buffer_size);
         
-        // This can race with the reader in the AudDecDecodeAndPlaySample function. This is
-        // not a problem because at worst, it just won't see that we've consumed this sample yet.
-        s_ReadIndex = (s_ReadIndex + 1) % CIRCULAR_BUFFER_SIZE;
+        // Release the slot only after we're done reading it
+        __atomic_store_n(&s_ReadIndex, readIndex + 1, __ATOMIC_RELEASE);
     }
     else {
         memset(samples, 0, buffer_size);
@@ -37,6 +39,10 @@ static void AudioPlayerSampleCallback(void* samples, uint32_t buffer_size, void*
 void MoonlightInstance::AudDecInit(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURATION opusConfig) {
     int rc;
     
+    // Playback hasn't started yet, so nothing else is touching the ring
+    s_ReadIndex = 0;
+    s_WriteIndex = 0;
+    
     g_Instance->m_OpusDecoder = opus_multistream_decoder_create(opusConfig->sampleRate,
                                                                 opusConfig->channelCount,
                                                                 opusConfig->streams,
@@ -62,23 +68,20 @@ void MoonlightInstance::AudDecCleanup(void) {
 
 void MoonlightInstance::AudDecDecodeAndPlaySample(char* sampleData, int sampleLength) {
     int decodeLen;
-        
-    // Check if there is space for this sample in the buffer. Again, this can race
-    // but in the worst case, we'll not see the sample callback having consumed a sample.
-    if (((s_WriteIndex + 1) % CIRCULAR_BUFFER_SIZE) == s_ReadIndex) {
+    unsigned int writeIndex = __atomic_load_n(&s_WriteIndex, __ATOMIC_RELAXED);
+    
+    // Check if there is space for this sample in the buffer. This can race with the
+    // sample callback, but in the worst case we'll not see it having consumed a sample.
+    // The acquire ensures it has finished reading a slot before we overwrite it.
+    if (writeIndex - __atomic_load_n(&s_ReadIndex, __ATOMIC_ACQUIRE) >= CIRCULAR_BUFFER_SIZE) {
         return;
     }
     
     decodeLen = opus_multistream_decode(g_Instance->m_OpusDecoder, (unsigned char *)sampleData, sampleLength,
-                                        s_CircularBuffer[s_WriteIndex], FRAME_SIZE, 0);
+                                        s_CircularBuffer[writeIndex & CIRCULAR_BUFFER_MASK], FRAME_SIZE, 0);
     if (decodeLen > 0) {
-        // Use a full memory barrier to ensure the circular buffer is written before incrementing the index
-        __sync_synchronize();
-        
-        // This can race with the reader in the sample callback, however this is a benign
-        // race since we'll either read the original value of s_WriteIndex (which is safe,
-        // we just won't consider this sample) or the new value of s_WriteIndex
-        s_WriteIndex = (s_WriteIndex + 1) % CIRCULAR_BUFFER_SIZE;
+        // Publish the sample only after it has been written
+        __atomic_store_n(&s_WriteIndex, writeIndex + 1, __ATOMIC_RELEASE);
     }
 }
 
@@ -1,4 +1,7 @@
 COMMON_C_DIR := moonlight-common-c/src
+# OpenAES encrypts the input stream inside moonlight-common-c. PNaCl
+# bitcode can't use AES instructions, so an accelerated backend for it
+# would take the same portable C path here; any change belongs upstream.
 OPENAES_DIR := $(COMMON_C_DIR)/OpenAES
 ENET_DIR := moonlight-common-c/enet
 
@@ -15,6 +18,11 @@ ENET_SOURCE := \
 
 ENET_INCLUDE := $(ENET_DIR)/include
 
+# moonlight-common-c is a submodule, so changes to the streaming core
+# (e.g. reorder/FEC statistics from RtpReorderQueue.c and
+# VideoDepacketizer.c) belong upstream. Its listener callbacks don't
+# report them yet; until they do, the client's own view of loss is the
+# IDR request/avoidance counts posted by viddec.cpp.
 COMMON_C_SOURCE := \
 	$(COMMON_C_DIR)/AudioStream.c         \
 	$(COMMON_C_DIR)/ByteBuffer.c          \
@@ -36,4 +44,11 @@ COMMON_C_SOURCE := \
 
 COMMON_C_INCLUDE := $(COMMON_C_DIR) $(ENET_INCLUDE)
 
+# Socket options for the streaming sockets are set in PlatformSockets.c.
+# nacl_io passes SO_RCVBUF through to PPB_UDPSocket, which caps it at
+# 1 MiB; SO_BUSY_POLL has no equivalent since every receive is an IPC
+# to the browser process.
+# NO_MSGAPI: nacl_io implements neither recvmsg() nor recvmmsg(), so
+# PlatformSockets.c must stay on one recv() per datagram here. Batched
+# receive would need nacl_io support first.
 COMMON_C_C_FLAGS := -DLC_CHROME -Wno-missing-braces -DHAS_SOCKLEN_T=1 -DHAS_FCNTL=1 -DNO_MSGAPI=1
\ No newline at end of file
@@ -155,10 +155,47 @@ static inline uint32_t bs_peek_u1(bs_t* b)
 }
 
 
+// advance the position by n bits without reading them
+static inline void bs_advance_bits(bs_t* b, int n)
+{
+    int pos = (8 - b->bits_left) + n;
+    b->p += pos / 8;
+    b->bits_left = 8 - (pos % 8);
+}
+
+// load the next nbytes bytes big-endian, with bytes at and past the end of the buffer
+// reading as zero, just as bs_read_u1 returns zero bits there
+static inline uint64_t bs_load_bytes(bs_t* b, int nbytes)
+{
+    uint64_t w = 0;
+    int avail = (b->p < b->end) ? (int)(b->end - b->p) : 0;
+    int i;
+    for (i = 0; i < nbytes; i++)
+    {
+        w = (w << 8) | (i < avail ? b->p[i] : 0);
+    }
+    return w;
+}
+
 static inline uint32_t bs_read_u(bs_t* b, int n)
 {
     uint32_t r = 0;
     int i;
+
+    // single-bit flags are most of the fields in parameter sets and slice headers,
+    // and don't need the byte window
+    if (n == 1) { return bs_read_u1(b); }
+
+    // fast path: read the bytes covering the field at once and shift it out
+    if (n > 0 && n <= 32)
+    {
+        int nbytes = (8 - b->bits_left + n + 7) / 8;
+        uint64_t w = bs_load_bytes(b, nbytes);
+        r = (uint32_t)(w >> (nbytes*8 - (8 - b->bits_left) - n)) & (uint32_t)(0xFFFFFFFFu >> (32 - n));
+        bs_advance_bits(b, n);
+        return r;
+    }
+
     for (i = 0; i < n; i++)
     {
         r |= ( bs_read_u1(b) << ( n - i - 1 ) );
@@ -168,11 +205,7 @@ static inline uint32_t bs_read_u(bs_t* b, int n)
 
 static inline void bs_skip_u(bs_t* b, int n)
 {
-    int i;
-    for ( i = 0; i < n; i++ ) 
-    {
-        bs_skip_u1( b );
-    }
+    if (n > 0) { bs_advance_bits(b, n); }
 }
 
 static inline uint32_t bs_read_f(bs_t* b, int n) { return bs_read_u(b, n); }
@@ -195,6 +228,36 @@ static inline uint32_t bs_read_ue(bs_t* b)
     int32_t r = 0;
     int i = 0;
 
+    // fastest path: a lone 1 bit codes 0, the most common value
+    if (! bs_eof(b) && ((*(b->p)) >> ( b->bits_left - 1 )) & 0x01)
+    {
+        bs_skip_u1(b);
+        return 0;
+    }
+
+    // fast path: count the leading zeros with clz when the terminating 1 bit
+    // is within the next 4 bytes of the buffer
+    if (! bs_eof(b))
+    {
+        uint32_t w = (uint32_t)bs_load_bytes(b, 4);
+        w <<= 8 - b->bits_left;
+        if (w != 0)
+        {
+            i = __builtin_clz(w);
+            // at least 25 bits of w are valid, so short codes can be taken straight from
+            // it: the top 2i+1 bits are the prefix, the 1 bit and the suffix, i.e. codeNum + 1
+            if (2*i + 1 <= 25)
+            {
+                bs_advance_bits(b, 2*i + 1);
+                return (w >> (31 - 2*i)) - 1;
+            }
+            bs_advance_bits(b, i + 1);
+            r = bs_read_u(b, i);
+            r += (1 << i) - 1;
+            return r;
+        }
+    }
+
     while( (bs_read_u1(b) == 0) && (i < 32) && (!bs_eof(b)) )
     {
         i++;
@@ -238,6 +301,29 @@ static inline void bs_write_u1(bs_t* b, uint32_t v)
 static inline void bs_write_u(bs_t* b, int n, uint32_t v)
 {
     int i;
+
+    // fast path: merge the whole field into the bytes it covers when all of them are inside the buffer
+    int nbytes = (8 - b->bits_left + n + 7) / 8;
+    if (n > 0 && n <= 32 && b->end - b->p >= nbytes)
+    {
+        int shift = nbytes*8 - (8 - b->bits_left) - n;
+        uint64_t mask = (((uint64_t)1 << n) - 1) << shift;
+        uint64_t w = 0;
+        for (i = 0; i < nbytes; i++)
+        {
+            w = (w << 8) | b->p[i];
+        }
+        w = (w & ~mask) | (((uint64_t)v << shift) & mask);
+        for (i = nbytes - 1; i >= 0; i--)
+        {
+            b->p[i] = (uint8_t)w;
+            w >>= 8;
+        }
+        bs_advance_bits(b, n);
+        return;
+    }
+
+    // slow path preserves the bit-by-bit behavior at and past the end of the buffer
     for (i = 0; i < n; i++)
     {
         bs_write_u1(b, (v >> ( n - i - 1 ))&0x01 );
@@ -23,50 +23,60 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "bs.h"
 #include "h264_stream.h"
 #include "h264_sei.h"
 
 /**
- Create a new H264 stream object.  Allocates all structures contained within it.
- @return    the stream object
+ Backing storage for a stream object.  The fixed per-stream structures and the
+ active SPS/PPS (slot 0 of each table) live in one block; the remaining
+ parameter-set slots are allocated the first time an id refers to them.
  */
-h264_stream_t* h264_new()
+typedef struct
 {
-    h264_stream_t* h = (h264_stream_t*)calloc(1, sizeof(h264_stream_t));
+    h264_stream_t h;
+    nal_t nal;
+    aud_t aud;
+    slice_header_t sh;
+    slice_data_rbsp_t slice_data;
+    sps_t sps0;
+    pps_t pps0;
+} h264_stream_arena_t;
 
-    h->nal = (nal_t*)calloc(1, sizeof(nal_t));
+/**
+ Create a new H264 stream object.  Allocates the fixed structures contained within it;
+ parameter-set table slots other than 0 are allocated on first use.
+ @return    the stream object, or NULL if it could not be allocated
+ */
+h264_stream_t* h264_new()
+{
+    h264_stream_arena_t* a = (h264_stream_arena_t*)calloc(1, sizeof(h264_stream_arena_t));
+    if (a == NULL) { return NULL; }
 
-    // initialize tables
-    for ( int i = 0; i < 32; i++ ) { h->sps_table[i] = (sps_t*)calloc(1, sizeof(sps_t)); }
-    for ( int i = 0; i < 256; i++ ) { h->pps_table[i] = (pps_t*)calloc(1, sizeof(pps_t)); }
+    h264_stream_t* h = &a->h;
+    h->nal = &a->nal;
+    h->sps_table[0] = &a->sps0;
+    h->pps_table[0] = &a->pps0;
 
     h->sps = h->sps_table[0];
     h->pps = h->pps_table[0];
-    h->aud = (aud_t*)calloc(1, sizeof(aud_t));
+    h->aud = &a->aud;
     h->num_seis = 0;
     h->seis = NULL;
     h->sei = NULL;  //This is a TEMP pointer at whats in h->seis...
-    h->sh = (slice_header_t*)calloc(1, sizeof(slice_header_t));
-    h->slice_data = (slice_data_rbsp_t*)calloc(1, sizeof(slice_data_rbsp_t));
+    h->sh = &a->sh;
+    h->slice_data = &a->slice_data;
 
     return h;   
 }
 
-
 /**
- Free an existing H264 stream object.  Frees all contained structures.
- @param[in,out] h   the stream object
+ Release the SEI messages and slice data held by a stream object.
  */
-void h264_free(h264_stream_t* h)
+static void h264_free_payloads(h264_stream_t* h)
 {
-    free(h->nal);
-
-    for ( int i = 0; i < 32; i++ ) { free( h->sps_table[i] ); }
-    for ( int i = 0; i < 256; i++ ) { free( h->pps_table[i] ); }
-
-    free(h->aud);
     if(h->seis != NULL)
     {
         for( int i = 0; i < h->num_seis; i++ )
@@ -76,10 +86,149 @@ void h264_free(h264_stream_t* h)
         }
         free(h->seis);
     }
-    free(h->sh);
+    h->seis = NULL;
+    h->num_seis = 0;
+    h->sei = NULL;
+
+    free(h->slice_data->rbsp_buf);
+    h->slice_data->rbsp_buf = NULL;
+    h->slice_data->rbsp_size = 0;
+}
+
+/**
+ Return the SPS table slot for an id, allocating it on first use.
+ Slot 0 is the active SPS itself, so callers copying between the two must skip that case.
+ @param[in,out] h   the stream object
+ @param[in] id      seq_parameter_set_id
+ @return            the slot, or NULL if the id is out of range or the slot could not be allocated
+ */
+sps_t* h264_sps_slot(h264_stream_t* h, int id)
+{
+    if (id < 0 || id >= 32) { return NULL; }
+    if (h->sps_table[id] == NULL)
+    {
+        h->sps_table[id] = (sps_t*)calloc(1, sizeof(sps_t));
+    }
+    return h->sps_table[id];
+}
+
+/**
+ Return the PPS table slot for an id, allocating it on first use.
+ @see h264_sps_slot
+ @param[in,out] h   the stream object
+ @param[in] id      pic_parameter_set_id
+ */
+pps_t* h264_pps_slot(h264_stream_t* h, int id)
+{
+    if (id < 0 || id >= 256) { return NULL; }
+    if (h->pps_table[id] == NULL)
+    {
+        h->pps_table[id] = (pps_t*)calloc(1, sizeof(pps_t));
+    }
+    return h->pps_table[id];
+}
+
+/**
+ Return a stream object to the state h264_new left it in, keeping any
+ parameter-set slots that have already been allocated so it can be reused.
+ @param[in,out] h   the stream object
+ */
+void h264_reset(h264_stream_t* h)
+{
+    if (h == NULL) { return; }
+
+    h264_free_payloads(h);
+
+    memset(h->nal, 0, sizeof(nal_t));
+    memset(h->aud, 0, sizeof(aud_t));
+    memset(h->sh, 0, sizeof(slice_header_t));
+
+    for ( int i = 0; i < 32; i++ ) { if (h->sps_table[i] != NULL) { memset(h->sps_table[i], 0, sizeof(sps_t)); } }
+    for ( int i = 0; i < 256; i++ ) { if (h->pps_table[i] != NULL) { memset(h->pps_table[i], 0, sizeof(pps_t)); } }
+
+    h->sps = h->sps_table[0];
+    h->pps = h->pps_table[0];
+}
+
+
+/**
+ Free an existing H264 stream object.  Frees all contained structures.
+ @param[in,out] h   the stream object
+ */
+void h264_free(h264_stream_t* h)
+{
+    if (h == NULL) { return; }
+
+    h264_free_payloads(h);
+
+    // Slot 0 of each table is part of the arena
+    for ( int i = 1; i < 32; i++ ) { free( h->sps_table[i] ); }
+    for ( int i = 1; i < 256; i++ ) { free( h->pps_table[i] ); }
+
+    // h is the first member of the arena, so this releases everything else
     free(h);
 }
 
+/**
+ Find the offset of the next 0x000001 start code at or after a given position.
+ Words that contain no zero byte cannot contain (or end) a start code, so they are skipped 8 bytes at a time.
+ @return  the offset of the start code, or size if there is none
+ */
+static int find_start_code(const uint8_t* buf, int i, int size)
+{
+    while (i + 3 <= size)
+    {
+        if (i + 8 <= size)
+        {
+            uint64_t x;
+            memcpy(&x, buf + i, sizeof(x));
+            if (!((x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL)) { i += 8; continue; }
+        }
+
+        if (buf[i] == 0x00 && buf[i+1] == 0x00 && buf[i+2] == 0x01) { return i; }
+        i++;
+    }
+
+    return size;
+}
+
+/**
+ Find the beginning and end of every NAL unit in a byte buffer containing Annex B H264 bitstream data, in a single pass.
+ Zero bytes in front of a start code (as in a 4-byte 0x00000001 start code) are not included in the preceding NAL.
+ The last NAL in the buffer ends at the end of the buffer.
+ @param[in]   buf         the buffer
+ @param[in]   size        the size of the buffer
+ @param[out]  nal_starts  the beginning offset of each nal, just after its start code
+ @param[out]  nal_ends    the end offset of each nal
+ @param[in]   max_nals    the size of the nal_starts and nal_ends arrays
+ @return                  the number of nals found
+ */
+int find_nal_units(uint8_t* buf, int size, int* nal_starts, int* nal_ends, int max_nals)
+{
+    int count = 0;
+    int sc = find_start_code(buf, 0, size);
+
+    while (sc < size && count < max_nals)
+    {
+        int start = sc + 3;
+        int next = find_start_code(buf, start, size);
+        int end = next;
+
+        if (next < size)
+        {
+            while (end > start && buf[end - 1] == 0x00) { end--; }
+        }
+
+        nal_starts[count] = start;
+        nal_ends[count] = end;
+        count++;
+
+        sc = next;
+    }
+
+    return count;
+}
+
 /**
  Find the beginning and end of a NAL (Network Abstraction Layer) unit in a byte buffer containing H264 bitstream data.
  @param[in]   buf        the buffer
@@ -88,48 +237,40 @@ void h264_free(h264_stream_t* h)
  @param[out]  nal_end    the end offset of the nal
  @return                 the length of the nal, or 0 if did not find start of nal, or -1 if did not find end of nal
  */
-// DEPRECATED - this will be replaced by a similar function with a slightly different API
+// DEPRECATED - use find_nal_units() instead
 int find_nal_unit(uint8_t* buf, int size, int* nal_start, int* nal_end)
 {
-    int i;
-    // find start
     *nal_start = 0;
     *nal_end = 0;
-    
-    i = 0;
-    while (   //( next_bits( 24 ) != 0x000001 && next_bits( 32 ) != 0x00000001 )
-        (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0x01) && 
-        (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0 || buf[i+3] != 0x01) 
-        )
-    {
-        i++; // skip leading zero
-        if (i+4 >= size) { return 0; } // did not find nal start
-    }
 
-    if  (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0x01) // ( next_bits( 24 ) != 0x000001 )
-    {
-        i++;
-    }
+    if (find_nal_units(buf, size, nal_start, nal_end, 1) == 0) { return 0; } // did not find nal start
+
+    if (*nal_end == size) { return -1; } // did not find nal end, stream ended first
 
-    if  (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0x01) { /* error, should never happen */ return 0; }
-    i+= 3;
-    *nal_start = i;
-    
-    while (   //( next_bits( 24 ) != 0x000000 && next_bits( 24 ) != 0x000001 )
-        (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0) && 
-        (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0x01) 
-        )
-    {
-        i++;
-        // FIXME the next line fails when reading a nal that ends exactly at the end of the data
-        if (i+3 >= size) { *nal_end = size; return -1; } // did not find nal end, stream ended first
-    }
-    
-    *nal_end = i;
     return (*nal_end - *nal_start);
 }
 
 
+/**
+ Copy the bytes preceding the next zero byte (or the end of the input).
+ If they don't all fit in the output, as much as fits is copied and an error is returned.
+ @return  the number of bytes copied, or -1 if the output is too small
+ */
+static int copy_nonzero_run(const uint8_t* in, int in_size, uint8_t* out, int out_size)
+{
+    const uint8_t* zero = (const uint8_t*)memchr(in, 0x00, in_size);
+    int run = (zero != NULL) ? (int)(zero - in) : in_size;
+
+    if (run > out_size)
+    {
+        memcpy(out, in, out_size > 0 ? out_size : 0);
+        return -1;
+    }
+
+    memcpy(out, in, run);
+    return run;
+}
+
 /**
    Convert RBSP data to NAL data (Annex B format).
    The size of nal_buf must be 4/3 * the size of the rbsp_buf (rounded up) to guarantee the output will fit.
@@ -151,6 +292,16 @@ int rbsp_to_nal(const uint8_t* rbsp_buf, const int* rbsp_size, uint8_t* nal_buf,
 
     for ( i = 0; i < *rbsp_size ; i++ )
     {
+        if ( count == 0 )
+        {
+            // fast path: nothing up to the next zero byte can need escaping, so copy it in one go
+            int run = copy_nonzero_run(rbsp_buf + i, *rbsp_size - i, nal_buf + j, *nal_size - j);
+            if ( run < 0 ) { return -1; } // error, not enough space
+            i += run;
+            j += run;
+            if ( i >= *rbsp_size ) { break; }
+        }
+
         if ( j >= *nal_size ) 
         {
             // error, not enough space
@@ -200,6 +351,16 @@ int nal_to_rbsp(const uint8_t* nal_buf, int* nal_size, uint8_t* rbsp_buf, int* r
   
     for( i = 0; i < *nal_size; i++ )
     { 
+        if( count == 0 )
+        {
+            // fast path: there can't be an emulation prevention byte before the next zero byte, so copy up to it in one go
+            int run = copy_nonzero_run(nal_buf + i, *nal_size - i, rbsp_buf + j, *rbsp_size - j);
+            if ( run < 0 ) { return -1; } // error, not enough space
+            i += run;
+            j += run;
+            if( i >= *nal_size ) { break; }
+        }
+
         // in NAL unit, 0x000000, 0x000001 or 0x000002 shall not occur at any byte-aligned position
         if( ( count == 2 ) && ( nal_buf[i] < 0x03) ) 
         {
@@ -256,13 +417,12 @@ int peek_nal_unit(h264_stream_t* h, uint8_t* buf, int size)
 {
     nal_t* nal = h->nal;
 
-    bs_t* b = bs_new(buf, size);
-
-    nal->forbidden_zero_bit = bs_read_f(b,1);
-    nal->nal_ref_idc = bs_read_u(b,2);
-    nal->nal_unit_type = bs_read_u(b,5);
+    bs_t b;
+    bs_init(&b, buf, size);
 
-    bs_free(b);
+    nal->forbidden_zero_bit = bs_read_f(&b,1);
+    nal->nal_ref_idc = bs_read_u(&b,2);
+    nal->nal_unit_type = bs_read_u(&b,5);
 
     // basic verification, per 7.4.1
     if ( nal->forbidden_zero_bit ) { return -1; }
@@ -292,3 +452,49 @@ int peek_nal_unit(h264_stream_t* h, uint8_t* buf, int size)
 }
 
 
+/**
+ Read the NAL header and the leading slice header fields (up to and including frame_num) of a coded slice
+ without allocating or touching any stream object.  Only the first few bytes of the NAL are unescaped, into
+ a stack buffer, so this is cheap enough to run on every slice.
+ Assumes separate_colour_plane_flag is 0, which holds for every profile below High 4:4:4.
+ @param[in] buf                 the nal data, starting at the NAL header (without start code)
+ @param[in] size                size of the nal data
+ @param[in] log2_max_frame_num  log2_max_frame_num_minus4 + 4 from the active SPS
+ @param[out] shp                filled in with the parsed fields
+ @return nal unit type if it is a coded slice that parsed successfully, or -1 otherwise
+*/
+int peek_slice_header(const uint8_t* buf, int size, int log2_max_frame_num, slice_header_prefix_t* shp)
+{
+    // NAL header, first_mb_in_slice, slice_type, pic_parameter_set_id and a 16 bit
+    // frame_num fit in 12 bytes of RBSP; leave room for emulation prevention bytes.
+    uint8_t rbsp_buf[20];
+    int nal_size = size < (int)sizeof(rbsp_buf) ? size : (int)sizeof(rbsp_buf);
+    int rbsp_size = sizeof(rbsp_buf);
+    bs_t b;
+
+    if ( nal_size < 1 ) { return -1; }
+    if ( nal_to_rbsp(buf, &nal_size, rbsp_buf, &rbsp_size) < 0 ) { return -1; }
+
+    bs_init(&b, rbsp_buf, rbsp_size);
+
+    if ( bs_read_u1(&b) ) { return -1; } // forbidden_zero_bit
+    shp->nal_ref_idc = bs_read_u(&b, 2);
+    shp->nal_unit_type = bs_read_u(&b, 5);
+
+    if ( shp->nal_unit_type != NAL_UNIT_TYPE_CODED_SLICE_NON_IDR &&
+         shp->nal_unit_type != NAL_UNIT_TYPE_CODED_SLICE_IDR )
+    {
+        return -1;
+    }
+
+    shp->idr_pic_flag = ( shp->nal_unit_type == NAL_UNIT_TYPE_CODED_SLICE_IDR );
+    shp->first_mb_in_slice = bs_read_ue(&b);
+    shp->slice_type = bs_read_ue(&b);
+    shp->pic_parameter_set_id = bs_read_ue(&b);
+    shp->frame_num = bs_read_u(&b, log2_max_frame_num);
+
+    if ( bs_overrun(&b) ) { return -1; }
+    if ( shp->slice_type > SH_SLICE_TYPE_SI_ONLY || shp->pic_parameter_set_id > 255 ) { return -1; }
+
+    return shp->nal_unit_type;
+}
@@ -337,7 +337,8 @@ void read_seq_parameter_set_rbsp(h264_stream_t* h, bs_t* b)
 
     if( 1 )
     {
-        memcpy(h->sps_table[sps->seq_parameter_set_id], h->sps, sizeof(sps_t));
+        sps_t* sps_slot = h264_sps_slot(h, sps->seq_parameter_set_id);
+        if (sps_slot != NULL && sps_slot != h->sps) { memcpy(sps_slot, h->sps, sizeof(sps_t)); }
     }
 }
 
@@ -587,7 +588,8 @@ void read_pic_parameter_set_rbsp(h264_stream_t* h, bs_t* b)
 
     if( 1 )
     {
-        memcpy(h->pps, h->pps_table[pps->pic_parameter_set_id], sizeof(pps_t));
+        pps_t* pps_slot = h264_pps_slot(h, pps->pic_parameter_set_id);
+        if (pps_slot != NULL && pps_slot != h->pps) { memcpy(h->pps, pps_slot, sizeof(pps_t)); }
     }
 }
 
@@ -764,8 +766,10 @@ void read_slice_header(h264_stream_t* h, bs_t* b)
     // TODO check existence, otherwise fail
     pps_t* pps = h->pps;
     sps_t* sps = h->sps;
-    memcpy(h->pps_table[sh->pic_parameter_set_id], h->pps, sizeof(pps_t));
-    memcpy(h->sps_table[pps->seq_parameter_set_id], h->sps, sizeof(sps_t));
+    pps_t* pps_slot = h264_pps_slot(h, sh->pic_parameter_set_id);
+    if (pps_slot != NULL && pps_slot != h->pps) { memcpy(pps_slot, h->pps, sizeof(pps_t)); }
+    sps_t* sps_slot = h264_sps_slot(h, pps->seq_parameter_set_id);
+    if (sps_slot != NULL && sps_slot != h->sps) { memcpy(sps_slot, h->sps, sizeof(sps_t)); }
 
     sh->frame_num = bs_read_u(b, sps->log2_max_frame_num_minus4 + 4 ); // was u(v)
     if( !sps->frame_mbs_only_flag )
@@ -1038,25 +1042,31 @@ void write_dec_ref_pic_marking(h264_stream_t* h, bs_t* b);
 //7.3.1 NAL unit syntax
 int write_nal_unit(h264_stream_t* h, uint8_t* buf, int size)
 {
-    nal_t* nal = h->nal;
+    uint8_t* rbsp_buf = (uint8_t*)calloc(1, size);
 
-    int nal_size = size;
-    int rbsp_size = size;
-    uint8_t* rbsp_buf = (uint8_t*)calloc(1, rbsp_size);
+    int rc = write_nal_unit_with_scratch(h, buf, size, rbsp_buf, size);
 
-    if( 0 )
-    {
-    int rc = nal_to_rbsp(buf, &nal_size, rbsp_buf, &rbsp_size);
+    free(rbsp_buf);
 
-    if (rc < 0) { free(rbsp_buf); return -1; } // handle conversion error
-    }
+    return rc;
+}
 
-    if( 1 )
-    {
-    rbsp_size = size*3/4; // NOTE this may have to be slightly smaller (3/4 smaller, worst case) in order to be guaranteed to fit
-    }
+/**
+ Write a NAL unit using caller-provided scratch memory for the RBSP instead of allocating it.
+ @param[in]      rbsp_buf   scratch buffer, which should be at least as large as buf
+ @param[in]      rbsp_buf_size  the size of the scratch buffer
+ @return  the size of the nal data written to buf, or -1 on error
+ */
+int write_nal_unit_with_scratch(h264_stream_t* h, uint8_t* buf, int size, uint8_t* rbsp_buf, int rbsp_buf_size)
+{
+    nal_t* nal = h->nal;
 
-    bs_t* b = bs_new(rbsp_buf, rbsp_size);
+    int nal_size = size;
+    int rbsp_size = size*3/4; // NOTE this may have to be slightly smaller (3/4 smaller, worst case) in order to be guaranteed to fit
+    if (rbsp_size > rbsp_buf_size) { rbsp_size = rbsp_buf_size; }
+
+    bs_t bs;
+    bs_t* b = bs_init(&bs, rbsp_buf, rbsp_size);
     /* forbidden_zero_bit */ bs_write_u(b, 1, 0);
     bs_write_u(b, 2, nal->nal_ref_idc);
     bs_write_u(b, 5, nal->nal_unit_type);
@@ -1105,19 +1115,13 @@ int write_nal_unit(h264_stream_t* h, uint8_t* buf, int size)
             return -1;
     }
 
-    if (bs_overrun(b)) { bs_free(b); free(rbsp_buf); return -1; }
+    if (bs_overrun(b)) { return -1; }
 
-    if( 1 )
-    {
     // now get the actual size used
     rbsp_size = bs_pos(b);
 
     int rc = rbsp_to_nal(rbsp_buf, &rbsp_size, buf, &nal_size);
-    if (rc < 0) { bs_free(b); free(rbsp_buf); return -1; }
-    }
-
-    bs_free(b);
-    free(rbsp_buf);
+    if (rc < 0) { return -1; }
 
     return nal_size;
 }
@@ -1224,7 +1228,8 @@ void write_seq_parameter_set_rbsp(h264_stream_t* h, bs_t* b)
 
     if( 0 )
     {
-        memcpy(h->sps_table[sps->seq_parameter_set_id], h->sps, sizeof(sps_t));
+        sps_t* sps_slot = h264_sps_slot(h, sps->seq_parameter_set_id);
+        if (sps_slot != NULL && sps_slot != h->sps) { memcpy(sps_slot, h->sps, sizeof(sps_t)); }
     }
 }
 
@@ -1474,7 +1479,8 @@ void write_pic_parameter_set_rbsp(h264_stream_t* h, bs_t* b)
 
     if( 0 )
     {
-        memcpy(h->pps, h->pps_table[pps->pic_parameter_set_id], sizeof(pps_t));
+        pps_t* pps_slot = h264_pps_slot(h, pps->pic_parameter_set_id);
+        if (pps_slot != NULL && pps_slot != h->pps) { memcpy(h->pps, pps_slot, sizeof(pps_t)); }
     }
 }
 
@@ -1651,8 +1657,10 @@ void write_slice_header(h264_stream_t* h, bs_t* b)
     // TODO check existence, otherwise fail
     pps_t* pps = h->pps;
     sps_t* sps = h->sps;
-    memcpy(h->pps_table[sh->pic_parameter_set_id], h->pps, sizeof(pps_t));
-    memcpy(h->sps_table[pps->seq_parameter_set_id], h->sps, sizeof(sps_t));
+    pps_t* pps_slot = h264_pps_slot(h, sh->pic_parameter_set_id);
+    if (pps_slot != NULL && pps_slot != h->pps) { memcpy(pps_slot, h->pps, sizeof(pps_t)); }
+    sps_t* sps_slot = h264_sps_slot(h, pps->seq_parameter_set_id);
+    if (sps_slot != NULL && sps_slot != h->sps) { memcpy(sps_slot, h->sps, sizeof(sps_t)); }
 
     bs_write_u(b, sps->log2_max_frame_num_minus4 + 4 , sh->frame_num); // was u(v)
     if( !sps->frame_mbs_only_flag )
@@ -2111,7 +2119,8 @@ void read_debug_seq_parameter_set_rbsp(h264_stream_t* h, bs_t* b)
 
     if( 1 )
     {
-        memcpy(h->sps_table[sps->seq_parameter_set_id], h->sps, sizeof(sps_t));
+        sps_t* sps_slot = h264_sps_slot(h, sps->seq_parameter_set_id);
+        if (sps_slot != NULL && sps_slot != h->sps) { memcpy(sps_slot, h->sps, sizeof(sps_t)); }
     }
 }
 
@@ -2361,7 +2370,8 @@ void read_debug_pic_parameter_set_rbsp(h264_stream_t* h, bs_t* b)
 
     if( 1 )
     {
-        memcpy(h->pps, h->pps_table[pps->pic_parameter_set_id], sizeof(pps_t));
+        pps_t* pps_slot = h264_pps_slot(h, pps->pic_parameter_set_id);
+        if (pps_slot != NULL && pps_slot != h->pps) { memcpy(h->pps, pps_slot, sizeof(pps_t)); }
     }
 }
 
@@ -2538,8 +2548,10 @@ void read_debug_slice_header(h264_stream_t* h, bs_t* b)
     // TODO check existence, otherwise fail
     pps_t* pps = h->pps;
     sps_t* sps = h->sps;
-    memcpy(h->pps_table[sh->pic_parameter_set_id], h->pps, sizeof(pps_t));
-    memcpy(h->sps_table[pps->seq_parameter_set_id], h->sps, sizeof(sps_t));
+    pps_t* pps_slot = h264_pps_slot(h, sh->pic_parameter_set_id);
+    if (pps_slot != NULL && pps_slot != h->pps) { memcpy(pps_slot, h->pps, sizeof(pps_t)); }
+    sps_t* sps_slot = h264_sps_slot(h, pps->seq_parameter_set_id);
+    if (sps_slot != NULL && sps_slot != h->sps) { memcpy(sps_slot, h->sps, sizeof(sps_t)); }
 
     printf("%d.%d: ", b->p - b->start, b->bits_left); sh->frame_num = bs_read_u(b, sps->log2_max_frame_num_minus4 + 4 ); printf("sh->frame_num: %d \n", sh->frame_num);  // was u(v)
     if( !sps->frame_mbs_only_flag )
@@ -368,22 +368,44 @@ typedef struct
     slice_header_t* sh;
     slice_data_rbsp_t* slice_data;
 
+    // Slots are allocated on first use; index them through h264_sps_slot/h264_pps_slot
     sps_t* sps_table[32];
     pps_t* pps_table[256];
     sei_t** seis;
 
 } h264_stream_t;
 
+/**
+   Leading fields of a slice header, as read by peek_slice_header.
+   @see 7.3.3 Slice header syntax
+*/
+typedef struct
+{
+    int nal_ref_idc;
+    int nal_unit_type;
+    int idr_pic_flag;
+    int first_mb_in_slice;
+    int slice_type;
+    int pic_parameter_set_id;
+    int frame_num;
+} slice_header_prefix_t;
+
 h264_stream_t* h264_new();
+void h264_reset(h264_stream_t* h);
 void h264_free(h264_stream_t* h);
 
+sps_t* h264_sps_slot(h264_stream_t* h, int id);
+pps_t* h264_pps_slot(h264_stream_t* h, int id);
+
 int find_nal_unit(uint8_t* buf, int size, int* nal_start, int* nal_end);
+int find_nal_units(uint8_t* buf, int size, int* nal_starts, int* nal_ends, int max_nals);
 
 int rbsp_to_nal(const uint8_t* rbsp_buf, const int* rbsp_size, uint8_t* nal_buf, int* nal_size);
 int nal_to_rbsp(const uint8_t* nal_buf, int* nal_size, uint8_t* rbsp_buf, int* rbsp_size);
 
 int read_nal_unit(h264_stream_t* h, uint8_t* buf, int size);
 int peek_nal_unit(h264_stream_t* h, uint8_t* buf, int size);
+int peek_slice_header(const uint8_t* buf, int size, int log2_max_frame_num, slice_header_prefix_t* shp);
 
 void read_seq_parameter_set_rbsp(h264_stream_t* h, bs_t* b);
 void read_scaling_list(bs_t* b, int* scalingList, int sizeOfScalingList, int* useDefaultScalingMatrixFlag );
@@ -410,6 +432,7 @@ void read_dec_ref_pic_marking(h264_stream_t* h, bs_t* b);
 int more_rbsp_trailing_data(h264_stream_t* h, bs_t* b);
 
 int write_nal_unit(h264_stream_t* h, uint8_t* buf, int size);
+int write_nal_unit_with_scratch(h264_stream_t* h, uint8_t* buf, int size, uint8_t* rbsp_buf, int rbsp_buf_size);
 
 void write_seq_parameter_set_rbsp(h264_stream_t* h, bs_t* b);
 void write_scaling_list(bs_t* b, int* scalingList, int sizeOfScalingList, int* useDefaultScalingMatrixFlag );
@@ -0,0 +1,224 @@
+/*
+ * Microbenchmark for the bs.h reader fast paths.
+ *
+ * Parses the fields of the SPS, PPS and slice headers a GameStream host sends for a
+ * 1080p60 High profile stream (CABAC, POC type 2, four slices per frame), once with the
+ * original bit-at-a-time reader from bs_ref.h and once with bs.h, and reports the time
+ * per header (best of several runs). Both readers must decode the same values.
+ *
+ * The headers are built here from their field lists rather than checked in as captures,
+ * so the two readers see exactly the same bits as the plugin's parsers would.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bs.h"
+#include "bs_ref.h"
+
+#define ITERATIONS 200000
+// Best of this many runs, to keep scheduling noise out of the numbers
+#define RUNS 25
+
+enum { U, UE, SE };
+
+typedef struct
+{
+    int type;
+    int bits;       // for U fields
+    int32_t value;
+} field_t;
+
+typedef struct
+{
+    const char* name;
+    const field_t* fields;
+    int count;
+    int data_bytes; // slice data following the header in the same NAL
+    uint8_t rbsp[96];
+    int size;
+} header_t;
+
+#define FIELDS(a) a, (int)(sizeof(a) / sizeof(a[0]))
+
+// seq_parameter_set_rbsp(): High profile, level 4.2, 1920x1080 with bottom cropping,
+// VUI with timing info and bitstream restrictions
+static const field_t sps_fields[] = {
+    { U, 8, 100 }, { U, 8, 0 }, { U, 8, 42 }, { UE, 0, 0 },
+    { UE, 0, 1 }, { UE, 0, 0 }, { UE, 0, 0 }, { U, 1, 0 }, { U, 1, 0 },
+    { UE, 0, 0 }, { UE, 0, 2 }, { UE, 0, 1 }, { U, 1, 0 },
+    { UE, 0, 119 }, { UE, 0, 67 }, { U, 1, 1 }, { U, 1, 1 },
+    { U, 1, 1 }, { UE, 0, 0 }, { UE, 0, 0 }, { UE, 0, 0 }, { UE, 0, 4 },
+    { U, 1, 1 },
+    { U, 1, 0 }, { U, 1, 0 },
+    { U, 1, 1 }, { U, 3, 5 }, { U, 1, 0 }, { U, 1, 1 }, { U, 8, 1 }, { U, 8, 1 }, { U, 8, 1 },
+    { U, 1, 0 },
+    { U, 1, 1 }, { U, 32, 1 }, { U, 32, 120 }, { U, 1, 1 },
+    { U, 1, 0 }, { U, 1, 0 }, { U, 1, 0 },
+    { U, 1, 1 }, { U, 1, 1 }, { UE, 0, 0 }, { UE, 0, 0 }, { UE, 0, 16 }, { UE, 0, 16 }, { UE, 0, 0 }, { UE, 0, 1 },
+};
+
+// pic_parameter_set_rbsp(): CABAC, 8x8 transform, deblocking control present
+static const field_t pps_fields[] = {
+    { UE, 0, 0 }, { UE, 0, 0 }, { U, 1, 1 }, { U, 1, 0 }, { UE, 0, 0 },
+    { UE, 0, 0 }, { UE, 0, 0 }, { U, 1, 0 }, { U, 2, 0 },
+    { SE, 0, -8 }, { SE, 0, 0 }, { SE, 0, 0 },
+    { U, 1, 1 }, { U, 1, 0 }, { U, 1, 0 },
+    { U, 1, 1 }, { U, 1, 0 }, { SE, 0, 0 },
+};
+
+// slice_header() of an IDR slice
+static const field_t idr_slice_fields[] = {
+    { UE, 0, 0 }, { UE, 0, 7 }, { UE, 0, 0 }, { U, 4, 0 }, { UE, 0, 3 },
+    { U, 1, 0 }, { U, 1, 0 },
+    { SE, 0, -6 }, { UE, 0, 0 }, { SE, 0, 0 }, { SE, 0, 0 },
+};
+
+// slice_header() of the P slices of a frame split four ways
+#define P_SLICE_FIELDS(first_mb) { \
+    { UE, 0, first_mb }, { UE, 0, 5 }, { UE, 0, 0 }, { U, 4, 9 }, \
+    { U, 1, 0 }, { U, 1, 0 }, { U, 1, 0 }, \
+    { UE, 0, 0 }, { SE, 0, -3 }, { UE, 0, 0 }, { SE, 0, 0 }, { SE, 0, 0 }, \
+}
+static const field_t p_slice0_fields[] = P_SLICE_FIELDS(0);
+static const field_t p_slice1_fields[] = P_SLICE_FIELDS(2040);
+static const field_t p_slice2_fields[] = P_SLICE_FIELDS(4080);
+static const field_t p_slice3_fields[] = P_SLICE_FIELDS(6120);
+
+static header_t headers[] = {
+    { "SPS", FIELDS(sps_fields), 0 },
+    { "PPS", FIELDS(pps_fields), 0 },
+    { "IDR slice", FIELDS(idr_slice_fields), 64 },
+    { "P slice 0", FIELDS(p_slice0_fields), 64 },
+    { "P slice 1", FIELDS(p_slice1_fields), 64 },
+    { "P slice 2", FIELDS(p_slice2_fields), 64 },
+    { "P slice 3", FIELDS(p_slice3_fields), 64 },
+};
+
+static void build_header(header_t* hdr)
+{
+    bs_t b;
+    int i;
+
+    memset(hdr->rbsp, 0, sizeof(hdr->rbsp));
+    bs_init(&b, hdr->rbsp, sizeof(hdr->rbsp));
+    for (i = 0; i < hdr->count; i++)
+    {
+        const field_t* f = &hdr->fields[i];
+        if (f->type == U) { bs_write_u(&b, f->bits, (uint32_t)f->value); }
+        else if (f->type == UE) { bs_write_ue(&b, (uint32_t)f->value); }
+        else { bs_write_se(&b, f->value); }
+    }
+    if (hdr->data_bytes == 0)
+    {
+        // rbsp_trailing_bits()
+        bs_write_u1(&b, 1);
+        while (!bs_byte_aligned(&b)) { bs_write_u1(&b, 0); }
+        hdr->size = bs_pos(&b);
+        return;
+    }
+
+    // cabac_alignment_one_bit, then some slice data
+    while (!bs_byte_aligned(&b)) { bs_write_u1(&b, 1); }
+    hdr->size = bs_pos(&b) + hdr->data_bytes;
+    for (i = bs_pos(&b); i < hdr->size; i++) { hdr->rbsp[i] = (uint8_t)(i * 0x9D + 0x5B); }
+}
+
+static int32_t ref_bs_read_se(bs_t* b)
+{
+    int32_t r = ref_bs_read_ue(b);
+    return (r & 0x01) ? (r + 1) / 2 : -(r / 2);
+}
+
+// Each reader is instantiated from the same body so the only difference is the bs.h calls
+#define DEFINE_PARSER(name, read_u, read_ue, read_se) \
+    static uint32_t name(const header_t* hdr) \
+    { \
+        bs_t b; \
+        uint32_t sum = 0; \
+        int i; \
+        bs_init(&b, (uint8_t*)hdr->rbsp, hdr->size); \
+        for (i = 0; i < hdr->count; i++) \
+        { \
+            const field_t* f = &hdr->fields[i]; \
+            if (f->type == U) { sum = sum * 31 + read_u(&b, f->bits); } \
+            else if (f->type == UE) { sum = sum * 31 + read_ue(&b); } \
+            else { sum = sum * 31 + (uint32_t)read_se(&b); } \
+        } \
+        return sum; \
+    }
+
+DEFINE_PARSER(parse_ref, ref_bs_read_u, ref_bs_read_ue, ref_bs_read_se)
+DEFINE_PARSER(parse_fast, bs_read_u, bs_read_ue, bs_read_se)
+
+static uint32_t expected_sum(const header_t* hdr)
+{
+    uint32_t sum = 0;
+    int i;
+    for (i = 0; i < hdr->count; i++)
+    {
+        const field_t* f = &hdr->fields[i];
+        uint32_t v = (uint32_t)f->value;
+        if (f->type == U && f->bits < 32) { v &= (1u << f->bits) - 1; }
+        sum = sum * 31 + v;
+    }
+    return sum;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double time_parser(uint32_t (*parse)(const header_t*), const header_t* hdr, uint32_t* sum)
+{
+    volatile uint32_t sink = 0;
+    double best = 0;
+    int run, i;
+    for (run = 0; run < RUNS; run++)
+    {
+        double start = now_ns();
+        for (i = 0; i < ITERATIONS; i++)
+        {
+            sink += parse(hdr);
+        }
+        double elapsed = (now_ns() - start) / ITERATIONS;
+        if (run == 0 || elapsed < best) { best = elapsed; }
+    }
+    *sum = parse(hdr);
+    (void)sink;
+    return best;
+}
+
+int main(void)
+{
+    int failed = 0;
+    size_t i;
+
+    printf("%-10s %9s %12s %12s %8s\n", "header", "nal bytes", "baseline ns", "bs.h ns", "speedup");
+    for (i = 0; i < sizeof(headers) / sizeof(headers[0]); i++)
+    {
+        header_t* hdr = &headers[i];
+        uint32_t ref_sum, fast_sum;
+        double ref_ns, fast_ns;
+
+        build_header(hdr);
+        ref_ns = time_parser(parse_ref, hdr, &ref_sum);
+        fast_ns = time_parser(parse_fast, hdr, &fast_sum);
+
+        if (ref_sum != expected_sum(hdr) || fast_sum != expected_sum(hdr))
+        {
+            fprintf(stderr, "%s: decoded values differ from the encoded ones\n", hdr->name);
+            failed = 1;
+        }
+
+        printf("%-10s %9d %12.1f %12.1f %7.2fx\n", hdr->name, hdr->size, ref_ns, fast_ns, ref_ns / fast_ns);
+    }
+
+    return failed;
+}
@@ -0,0 +1,428 @@
+/*
+ * Differential test for the h264bitstream fast paths.
+ *
+ * The bit reader/writer in bs.h, the escape handling in nal_to_rbsp/rbsp_to_nal and
+ * the start code search in find_nal_units all have word-at-a-time fast paths. Each one
+ * is run against the original bit-at-a-time / byte-at-a-time code (copied under a
+ * ref_ prefix, here and in bs_ref.h) on random input, and any difference in results,
+ * positions or output bytes fails the test.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bs.h"
+#include "bs_ref.h"
+#include "h264_stream.h"
+
+#define ITERATIONS 200000
+#define MAX_BUF 256
+#define MAX_NALS 64
+
+static int failures = 0;
+
+#define CHECK(cond, it) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: iteration %d: check failed: %s\n", __FILE__, __LINE__, (it), #cond); \
+            if (++failures > 20) { exit(1); } \
+        } \
+    } while (0)
+
+// Baseline NAL helpers (the bs.h ones are in bs_ref.h)
+
+static int ref_rbsp_to_nal(const uint8_t* rbsp_buf, const int* rbsp_size, uint8_t* nal_buf, int* nal_size)
+{
+    int i;
+    int j     = 0;
+    int count = 0;
+
+    for ( i = 0; i < *rbsp_size ; i++ )
+    {
+        if ( j >= *nal_size )
+        {
+            return -1;
+        }
+
+        if ( ( count == 2 ) && !(rbsp_buf[i] & 0xFC) )
+        {
+            nal_buf[j] = 0x03;
+            j++;
+            count = 0;
+        }
+        nal_buf[j] = rbsp_buf[i];
+        if ( rbsp_buf[i] == 0x00 )
+        {
+            count++;
+        }
+        else
+        {
+            count = 0;
+        }
+        j++;
+    }
+
+    *nal_size = j;
+    return j;
+}
+
+static int ref_nal_to_rbsp(const uint8_t* nal_buf, int* nal_size, uint8_t* rbsp_buf, int* rbsp_size)
+{
+    int i;
+    int j     = 0;
+    int count = 0;
+
+    for( i = 0; i < *nal_size; i++ )
+    {
+        if( ( count == 2 ) && ( nal_buf[i] < 0x03) )
+        {
+            return -1;
+        }
+
+        if( ( count == 2 ) && ( nal_buf[i] == 0x03) )
+        {
+            if((i < *nal_size - 1) && (nal_buf[i+1] > 0x03))
+            {
+                return -1;
+            }
+
+            if(i == *nal_size - 1)
+            {
+                break;
+            }
+
+            i++;
+            count = 0;
+        }
+
+        if ( j >= *rbsp_size )
+        {
+            return -1;
+        }
+
+        rbsp_buf[j] = nal_buf[i];
+        if(nal_buf[i] == 0x00)
+        {
+            count++;
+        }
+        else
+        {
+            count = 0;
+        }
+        j++;
+    }
+
+    *nal_size = i;
+    *rbsp_size = j;
+    return j;
+}
+
+static int ref_find_nal_unit(uint8_t* buf, int size, int* nal_start, int* nal_end)
+{
+    int i;
+    *nal_start = 0;
+    *nal_end = 0;
+
+    i = 0;
+    while (
+        (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0x01) &&
+        (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0 || buf[i+3] != 0x01)
+        )
+    {
+        i++;
+        if (i+4 >= size) { return 0; }
+    }
+
+    if  (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0x01)
+    {
+        i++;
+    }
+
+    if  (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0x01) { return 0; }
+    i+= 3;
+    *nal_start = i;
+
+    while (
+        (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0) &&
+        (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0x01)
+        )
+    {
+        i++;
+        if (i+3 >= size) { *nal_end = size; return -1; }
+    }
+
+    *nal_end = i;
+    return (*nal_end - *nal_start);
+}
+
+// Byte-at-a-time start code scan with the same contract as find_nal_units()
+static int ref_find_nal_units(const uint8_t* buf, int size, int* nal_starts, int* nal_ends, int max_nals)
+{
+    int count = 0;
+    int i = 0;
+    int start = -1;
+
+    while (i + 3 <= size)
+    {
+        if (buf[i] == 0x00 && buf[i+1] == 0x00 && buf[i+2] == 0x01)
+        {
+            if (start >= 0)
+            {
+                int end = i;
+                while (end > start && buf[end - 1] == 0x00) { end--; }
+                nal_starts[count] = start;
+                nal_ends[count] = end;
+                count++;
+                if (count == max_nals) { return count; }
+            }
+            start = i + 3;
+            i += 3;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    if (start >= 0)
+    {
+        nal_starts[count] = start;
+        nal_ends[count] = size;
+        count++;
+    }
+
+    return count;
+}
+
+// Random input
+
+// Mostly random bytes with plenty of zeros, but never three zero bytes in a row, so that
+// no Exp-Golomb prefix reaches the 32 bit case the baseline bs_read_ue() can't handle
+static void fill_bits(uint8_t* buf, int size)
+{
+    int i;
+    for (i = 0; i < size; i++)
+    {
+        int r = rand() % 4;
+        buf[i] = (r == 0) ? 0x00 : (r == 1) ? (uint8_t)(1 << (rand() % 8)) : (uint8_t)rand();
+        if (i >= 2 && buf[i] == 0x00 && buf[i-1] == 0x00 && buf[i-2] == 0x00) { buf[i] = 0x01; }
+    }
+}
+
+// Bytes that are dense in the values escape handling and start codes care about
+static void fill_nal(uint8_t* buf, int size)
+{
+    int i;
+    for (i = 0; i < size; i++)
+    {
+        int r = rand() % 8;
+        buf[i] = (r < 3) ? 0x00 : (r < 6) ? (uint8_t)(rand() % 5) : (uint8_t)rand();
+    }
+}
+
+static int same_position(const bs_t* a, const bs_t* b)
+{
+    return (a->p - a->start) == (b->p - b->start) && a->bits_left == b->bits_left;
+}
+
+static void test_bs_read(void)
+{
+    uint8_t buf[MAX_BUF];
+    int it;
+
+    for (it = 0; it < ITERATIONS; it++)
+    {
+        int size = rand() % 48;
+        bs_t ref, fast;
+        fill_bits(buf, size);
+        bs_init(&ref, buf, size);
+        bs_init(&fast, buf, size);
+
+        // run until a little way past the end to cover the bit-by-bit tail
+        while (ref.p <= ref.end + 1)
+        {
+            int op = rand() % 3;
+            int n = rand() % 33;
+            if (op == 0)
+            {
+                CHECK(ref_bs_read_u(&ref, n) == bs_read_u(&fast, n), it);
+            }
+            else if (op == 1)
+            {
+                CHECK(ref_bs_read_ue(&ref) == bs_read_ue(&fast), it);
+            }
+            else
+            {
+                ref_bs_skip_u(&ref, n);
+                bs_skip_u(&fast, n);
+            }
+            CHECK(same_position(&ref, &fast), it);
+            if (!same_position(&ref, &fast)) { break; }
+        }
+    }
+}
+
+static void test_bs_write(void)
+{
+    uint8_t ref_buf[MAX_BUF];
+    uint8_t fast_buf[MAX_BUF];
+    int it;
+
+    for (it = 0; it < ITERATIONS; it++)
+    {
+        int size = rand() % 48;
+        bs_t ref, fast;
+        // the writers must preserve whatever is around the bits they write
+        fill_nal(ref_buf, sizeof(ref_buf));
+        memcpy(fast_buf, ref_buf, sizeof(fast_buf));
+        bs_init(&ref, ref_buf, size);
+        bs_init(&fast, fast_buf, size);
+
+        while (ref.p <= ref.end + 1)
+        {
+            int n = rand() % 33;
+            uint32_t v = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+            ref_bs_write_u(&ref, n, v);
+            bs_write_u(&fast, n, v);
+            CHECK(same_position(&ref, &fast), it);
+            if (!same_position(&ref, &fast)) { break; }
+        }
+        CHECK(memcmp(ref_buf, fast_buf, sizeof(ref_buf)) == 0, it);
+    }
+}
+
+static void test_rbsp(void)
+{
+    uint8_t in[MAX_BUF];
+    uint8_t ref_out[MAX_BUF * 2];
+    uint8_t fast_out[MAX_BUF * 2];
+    int it;
+
+    for (it = 0; it < ITERATIONS; it++)
+    {
+        int size = rand() % MAX_BUF;
+        // sometimes too small, to cover the out of space errors
+        int out_size = (rand() % 4 == 0) ? rand() % (size + 1) : size * 4 / 3 + 1;
+        int ref_in_size = size, fast_in_size = size;
+        int ref_out_size = out_size, fast_out_size = out_size;
+        int ref_ret, fast_ret;
+        fill_nal(in, size);
+
+        memset(ref_out, 0xAA, sizeof(ref_out));
+        memset(fast_out, 0xAA, sizeof(fast_out));
+        ref_ret = ref_rbsp_to_nal(in, &ref_in_size, ref_out, &ref_out_size);
+        fast_ret = rbsp_to_nal(in, &fast_in_size, fast_out, &fast_out_size);
+        CHECK(ref_ret == fast_ret, it);
+        if (ref_ret >= 0)
+        {
+            CHECK(ref_out_size == fast_out_size, it);
+            CHECK(memcmp(ref_out, fast_out, ref_ret) == 0, it);
+        }
+
+        ref_in_size = fast_in_size = size;
+        ref_out_size = fast_out_size = out_size;
+        ref_ret = ref_nal_to_rbsp(in, &ref_in_size, ref_out, &ref_out_size);
+        fast_ret = nal_to_rbsp(in, &fast_in_size, fast_out, &fast_out_size);
+        CHECK(ref_ret == fast_ret, it);
+        if (ref_ret >= 0)
+        {
+            CHECK(ref_in_size == fast_in_size, it);
+            CHECK(ref_out_size == fast_out_size, it);
+            CHECK(memcmp(ref_out, fast_out, ref_ret) == 0, it);
+        }
+    }
+}
+
+// An Annex B stream of escaped NALs separated by 3 and 4 byte start codes
+static int make_stream(uint8_t* buf, int max_size)
+{
+    uint8_t rbsp[64];
+    int size = 0;
+    int nals = rand() % 6;
+    int n;
+
+    if (rand() % 2) { fill_nal(buf, size = rand() % 8); }
+
+    for (n = 0; n < nals; n++)
+    {
+        int rbsp_size = 1 + rand() % (int)sizeof(rbsp);
+        int nal_size;
+        if (size + 4 + rbsp_size * 2 > max_size) { break; }
+
+        if (rand() % 2) { buf[size++] = 0x00; }
+        buf[size++] = 0x00;
+        buf[size++] = 0x00;
+        buf[size++] = 0x01;
+
+        fill_nal(rbsp, rbsp_size);
+        // rbsp_trailing_bits() means a NAL never ends in a zero byte
+        if (rbsp[rbsp_size - 1] == 0x00) { rbsp[rbsp_size - 1] = 0x80; }
+        nal_size = max_size - size;
+        size += ref_rbsp_to_nal(rbsp, &rbsp_size, buf + size, &nal_size);
+    }
+
+    return size;
+}
+
+static void test_find_nal_units(void)
+{
+    uint8_t buf[MAX_BUF * 2];
+    int ref_starts[MAX_NALS], ref_ends[MAX_NALS];
+    int fast_starts[MAX_NALS], fast_ends[MAX_NALS];
+    int it;
+
+    for (it = 0; it < ITERATIONS; it++)
+    {
+        int size, max_nals, ref_count, fast_count, i;
+
+        // arbitrary bytes against the byte-at-a-time scan
+        size = rand() % (int)sizeof(buf);
+        max_nals = 1 + rand() % MAX_NALS;
+        fill_nal(buf, size);
+        ref_count = ref_find_nal_units(buf, size, ref_starts, ref_ends, max_nals);
+        fast_count = find_nal_units(buf, size, fast_starts, fast_ends, max_nals);
+        CHECK(ref_count == fast_count, it);
+        for (i = 0; i < ref_count && i < fast_count; i++)
+        {
+            CHECK(ref_starts[i] == fast_starts[i], it);
+            CHECK(ref_ends[i] == fast_ends[i], it);
+        }
+
+        // well formed streams against the original find_nal_unit(), which only gives
+        // a definite answer for a NAL that is followed by another start code
+        size = make_stream(buf, sizeof(buf));
+        if (size >= 4)
+        {
+            int ref_start, ref_end, fast_start, fast_end;
+            int ref_ret = ref_find_nal_unit(buf, size, &ref_start, &ref_end);
+            int fast_ret = find_nal_unit(buf, size, &fast_start, &fast_end);
+            if (ref_ret > 0)
+            {
+                CHECK(ref_ret == fast_ret, it);
+                CHECK(ref_start == fast_start, it);
+                CHECK(ref_end == fast_end, it);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+
+    test_bs_read();
+    test_bs_write();
+    test_rbsp();
+    test_find_nal_units();
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "bitstream_test: %d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("bitstream_test: all checks passed\n");
+    return 0;
+}
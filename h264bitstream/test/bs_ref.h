@@ -0,0 +1,89 @@
+/*
+ * The original bit-at-a-time bs.h reader and writer, kept under a ref_ prefix
+ * as the baseline for bitstream_test.c and bitstream_bench.c.
+ */
+
+#ifndef _H264_BS_REF_H
+#define _H264_BS_REF_H        1
+
+#include "bs.h"
+
+static inline uint32_t ref_bs_read_u1(bs_t* b)
+{
+    uint32_t r = 0;
+
+    b->bits_left--;
+
+    if (! bs_eof(b))
+    {
+        r = ((*(b->p)) >> b->bits_left) & 0x01;
+    }
+
+    if (b->bits_left == 0) { b->p ++; b->bits_left = 8; }
+
+    return r;
+}
+
+static inline void ref_bs_skip_u1(bs_t* b)
+{
+    b->bits_left--;
+    if (b->bits_left == 0) { b->p ++; b->bits_left = 8; }
+}
+
+static inline uint32_t ref_bs_read_u(bs_t* b, int n)
+{
+    uint32_t r = 0;
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        r |= ( ref_bs_read_u1(b) << ( n - i - 1 ) );
+    }
+    return r;
+}
+
+static inline void ref_bs_skip_u(bs_t* b, int n)
+{
+    int i;
+    for ( i = 0; i < n; i++ )
+    {
+        ref_bs_skip_u1( b );
+    }
+}
+
+static inline uint32_t ref_bs_read_ue(bs_t* b)
+{
+    int32_t r = 0;
+    int i = 0;
+
+    while( (ref_bs_read_u1(b) == 0) && (i < 32) && (!bs_eof(b)) )
+    {
+        i++;
+    }
+    r = ref_bs_read_u(b, i);
+    r += (1 << i) - 1;
+    return r;
+}
+
+static inline void ref_bs_write_u1(bs_t* b, uint32_t v)
+{
+    b->bits_left--;
+
+    if (! bs_eof(b))
+    {
+        (*(b->p)) &= ~(0x01 << b->bits_left);
+        (*(b->p)) |= ((v & 0x01) << b->bits_left);
+    }
+
+    if (b->bits_left == 0) { b->p ++; b->bits_left = 8; }
+}
+
+static inline void ref_bs_write_u(bs_t* b, int n, uint32_t v)
+{
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        ref_bs_write_u1(b, (v >> ( n - i - 1 ))&0x01 );
+    }
+}
+
+#endif
@@ -7,6 +7,7 @@
 #include <string.h>
 
 #include <mkcert.h>
+#include <hex.h>
 #include <openssl/bio.h>
 #include <openssl/pem.h>
 
@@ -15,7 +16,7 @@ EVP_PKEY *g_PrivateKey;
 char *g_UniqueId;
 char *g_CertHex;
 
-void MoonlightInstance::MakeCert(int32_t callbackId, pp::VarArray args)
+void MoonlightInstance::MakeCert(int32_t /*result*/, int32_t callbackId, pp::VarArray args)
 {
     pp::VarDictionary ret;
     ret.Set("callbackId", pp::Var(callbackId));
@@ -43,6 +44,8 @@ void MoonlightInstance::MakeCert(int32_t callbackId, pp::VarArray args)
     
     BIO_free(biokey);
     
+    mkcert_free(certKeyPair);
+    
     retData.Set("privateKey", pkey.c_str());
     retData.Set("cert", cert.c_str());
     
@@ -67,11 +70,11 @@ void MoonlightInstance::LoadCert(const char* certStr, const char* keyStr)
     }
     BIO_free_all(bio);
     
-    // Convert the PEM cert to hex
-    g_CertHex = (char*)malloc((strlen(certStr) * 2) + 1);
-    for (int i = 0; i < strlen(certStr); i++) {
-        sprintf(&g_CertHex[i * 2], "%02x", certStr[i]);
-    }
+    // Convert the PEM cert to hex once since it's sent with every pairing attempt
+    size_t certLen = strlen(certStr);
+    free(g_CertHex);
+    g_CertHex = (char*)malloc((certLen * 2) + 1);
+    hex_encode((const unsigned char*)certStr, g_CertHex, certLen);
     
     free(_certStr);
     free(_keyStr);
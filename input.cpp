@@ -28,15 +28,29 @@ static int ConvertPPButtonToLiButton(PP_InputEvent_MouseButton ppButton) {
 void MoonlightInstance::DidLockMouse(int32_t result) {
     m_MouseLocked = (result == PP_OK);
     if (m_MouseLocked) {
-        // Request an IDR frame to dump the frame queue that may have
-        // built up from the GL pipeline being stalled.
-        m_RequestIdrFrame = true;
+        // Dump the frame queue that may have built up from the GL
+        // pipeline being stalled.
+        SkipStalledPictures();
     }
 }
 
 void MoonlightInstance::MouseLockLost() {
     m_MouseLocked = false;
     m_KeyModifiers = 0;
+    
+    // Drop movement that hasn't been sent yet
+    m_MouseDeltaX = 0;
+    m_MouseDeltaY = 0;
+}
+
+void MoonlightInstance::SendPendingMouseMovement(int32_t unused) {
+    m_MouseMoveFlushPending = false;
+    
+    if (m_MouseDeltaX != 0 || m_MouseDeltaY != 0) {
+        LiSendMouseMoveEvent(m_MouseDeltaX, m_MouseDeltaY);
+        m_MouseDeltaX = 0;
+        m_MouseDeltaY = 0;
+    }
 }
 
 void MoonlightInstance::UpdateModifiers(PP_InputEvent_Type eventType, short keyCode) {
@@ -84,6 +98,8 @@ bool MoonlightInstance::HandleInputEvent(const pp::InputEvent& event) {
             
             pp::MouseInputEvent mouseEvent(event);
             
+            // Movement must reach the host before the click
+            SendPendingMouseMovement(0);
             LiSendMouseButtonEvent(BUTTON_ACTION_PRESS, ConvertPPButtonToLiButton(mouseEvent.GetButton()));
             return true;
         }
@@ -96,7 +112,15 @@ bool MoonlightInstance::HandleInputEvent(const pp::InputEvent& event) {
             pp::MouseInputEvent mouseEvent(event);
             pp::Point posDelta = mouseEvent.GetMovement();
             
-            LiSendMouseMoveEvent(posDelta.x(), posDelta.y());
+            // Coalesce all the movement that arrives before the main thread
+            // gets back to its message loop into a single input packet
+            m_MouseDeltaX += posDelta.x();
+            m_MouseDeltaY += posDelta.y();
+            if (!m_MouseMoveFlushPending) {
+                m_MouseMoveFlushPending = true;
+                pp::Module::Get()->core()->CallOnMainThread(0,
+                    m_CallbackFactory.NewCallback(&MoonlightInstance::SendPendingMouseMovement));
+            }
             return true;
         }
         
@@ -107,6 +131,7 @@ bool MoonlightInstance::HandleInputEvent(const pp::InputEvent& event) {
             
             pp::MouseInputEvent mouseEvent(event);
             
+            SendPendingMouseMovement(0);
             LiSendMouseButtonEvent(BUTTON_ACTION_RELEASE, ConvertPPButtonToLiButton(mouseEvent.GetButton()));
             return true;
         }
@@ -128,6 +153,7 @@ bool MoonlightInstance::HandleInputEvent(const pp::InputEvent& event) {
             
             // Send a scroll event if we've completed a full tick
             if (fullTicks != 0) {
+                SendPendingMouseMovement(0);
                 LiSendScrollEvent(fullTicks);
                 m_AccumulatedTicks -= fullTicks;
             }
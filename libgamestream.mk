@@ -1,6 +1,7 @@
 LIBGS_C_DIR := libgamestream
 
 LIBGS_C_SOURCE := \
+	$(LIBGS_C_DIR)/hex.c \
 	$(LIBGS_C_DIR)/http.c \
     $(LIBGS_C_DIR)/mkcert.c \
     $(LIBGS_C_DIR)/pairing.c \
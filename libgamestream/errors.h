@@ -26,4 +26,5 @@
 #define GS_WRONG_STATE -4
 #define GS_IO_ERROR -5
 #define GS_NOT_SUPPORTED_4K -6
+#define GS_CANCELLED -7
 
@@ -0,0 +1,54 @@
+/*
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hex.h"
+#include "errors.h"
+
+static const char k_HexDigits[] = "0123456789abcdef";
+
+// Maps an ASCII character to its nibble value biased by 0x10, so that
+// characters which aren't hex digits are left as zero entries
+static const unsigned char k_HexValues[256] = {
+    ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+    ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+    ['a'] = 0x1A, ['b'] = 0x1B, ['c'] = 0x1C, ['d'] = 0x1D, ['e'] = 0x1E, ['f'] = 0x1F,
+    ['A'] = 0x1A, ['B'] = 0x1B, ['C'] = 0x1C, ['D'] = 0x1D, ['E'] = 0x1E, ['F'] = 0x1F,
+};
+
+void hex_encode(const unsigned char *in, char *out, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        out[i * 2] = k_HexDigits[in[i] >> 4];
+        out[i * 2 + 1] = k_HexDigits[in[i] & 0xF];
+    }
+    out[len * 2] = 0;
+}
+
+int hex_decode(const char *in, unsigned char *out, size_t len) {
+    unsigned char invalid = 0;
+    
+    if (len % 2 != 0) {
+        return GS_INVALID;
+    }
+    
+    for (size_t i = 0; i < len; i += 2) {
+        unsigned char hi = k_HexValues[(unsigned char)in[i]];
+        unsigned char lo = k_HexValues[(unsigned char)in[i + 1]];
+        
+        invalid |= (unsigned char)~hi | (unsigned char)~lo;
+        out[i / 2] = (unsigned char)(((hi & 0xF) << 4) | (lo & 0xF));
+    }
+    
+    return (invalid & 0x10) ? GS_INVALID : GS_OK;
+}
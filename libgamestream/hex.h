@@ -0,0 +1,33 @@
+/*
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Writes len * 2 lowercase hex digits plus a null terminator to out
+void hex_encode(const unsigned char *in, char *out, size_t len);
+
+// Decodes len hex digits (len must be even) into len / 2 bytes of out.
+// Returns GS_INVALID if a non-hex character is found.
+int hex_decode(const char *in, unsigned char *out, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
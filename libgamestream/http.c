@@ -27,6 +27,9 @@
 #include <openssl/x509v3.h>
 #include <openssl/pem.h>
 
+// Fail fast if the host is unreachable rather than blocking the HTTP thread
+#define CONNECT_TIMEOUT_SECS 10L
+
 static CURL *curl;
 
 extern X509 *g_Cert;
@@ -75,13 +78,35 @@ int http_init() {
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, _write_curl);
   curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
   curl_easy_setopt(curl, CURLOPT_SSL_CTX_FUNCTION, *sslctx_function);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT_SECS);
 
   return GS_OK;
 }
 
+static int _xferinfo_curl(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+  volatile int *cancelled = (volatile int*)clientp;
+
+  // Returning non-zero aborts the transfer with CURLE_ABORTED_BY_CALLBACK
+  return *cancelled;
+}
+
 int http_request(char* url, PHTTP_DATA data) {
+  return http_request_cancellable(url, data, 0, NULL);
+}
+
+int http_request_cancellable(char* url, PHTTP_DATA data, long timeoutSecs, volatile int* cancelled) {
   curl_easy_setopt(curl, CURLOPT_WRITEDATA, data);
   curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeoutSecs);
+
+  if (cancelled != NULL) {
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, _xferinfo_curl);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, cancelled);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+  } else {
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+  }
 
   if (data->size > 0) {
     free(data->memory);
@@ -94,7 +119,9 @@ int http_request(char* url, PHTTP_DATA data) {
 
   CURLcode res = curl_easy_perform(curl);
   
-  if(res != CURLE_OK) {
+  if (res == CURLE_ABORTED_BY_CALLBACK) {
+    return GS_CANCELLED;
+  } else if(res != CURLE_OK) {
     return GS_FAILED;
   } else if (data->memory == NULL) {
     return GS_OUT_OF_MEMORY;
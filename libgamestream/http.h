@@ -33,6 +33,7 @@ typedef struct _HTTP_DATA {
 int http_init();
 PHTTP_DATA http_create_data();
 int http_request(char* url, PHTTP_DATA data);
+int http_request_cancellable(char* url, PHTTP_DATA data, long timeoutSecs, volatile int* cancelled);
 void http_free_data(PHTTP_DATA data);
 
 #ifdef __cplusplus
@@ -34,21 +34,22 @@ int mkcert(X509 **x509p, EVP_PKEY **pkeyp, int bits, int serial, int years);
 int add_ext(X509 *cert, int nid, char *value);
 
 CERT_KEY_PAIR mkcert_generate() {
-    BIO *bio_err;
     X509 *x509 = NULL;
     EVP_PKEY *pkey = NULL;
-    PKCS12 *p12 = NULL;
-   
+    
+#ifndef NDEBUG
+    BIO *bio_err;
+    
     CRYPTO_mem_ctrl(CRYPTO_MEM_CHECK_ON);
     bio_err = BIO_new_fp(stderr, BIO_NOCLOSE);
+#endif
     
     SSLeay_add_all_algorithms();
     ERR_load_crypto_strings();
     
     mkcert(&x509, &pkey, NUM_BITS, SERIAL, NUM_YEARS);
 
-    p12 = PKCS12_create("limelight", "GameStream", pkey, x509, NULL, 0, 0, 0, 0, 0);
-
+#ifndef NDEBUG
 #ifndef OPENSSL_NO_ENGINE
     ENGINE_cleanup();
 #endif
@@ -56,8 +57,11 @@ CERT_KEY_PAIR mkcert_generate() {
     
     CRYPTO_mem_leaks(bio_err);
     BIO_free(bio_err);
+#endif
     
-    return (CERT_KEY_PAIR) {x509, pkey, p12};
+    // The PKCS12 bundle is only needed when saving to disk, so
+    // mkcert_save() creates it on demand.
+    return (CERT_KEY_PAIR) {x509, pkey, NULL};
 }
 
 void mkcert_free(CERT_KEY_PAIR certKeyPair) {
@@ -71,10 +75,19 @@ void mkcert_save(const char* certFile, const char* p12File, const char* keyPairF
     FILE* keyPairFilePtr = fopen(keyPairFile, "w");
     FILE* p12FilePtr = fopen(p12File, "wb");
     
+    PKCS12* p12 = certKeyPair.p12;
+    if (p12 == NULL) {
+        p12 = PKCS12_create("limelight", "GameStream", certKeyPair.pkey, certKeyPair.x509, NULL, 0, 0, 0, 0, 0);
+    }
+    
     //TODO: error check
     PEM_write_PrivateKey(keyPairFilePtr, certKeyPair.pkey, NULL, NULL, 0, NULL, NULL);
     PEM_write_X509(certFilePtr, certKeyPair.x509);
-    i2d_PKCS12_fp(p12FilePtr, certKeyPair.p12);
+    i2d_PKCS12_fp(p12FilePtr, p12);
+    
+    if (p12 != certKeyPair.p12) {
+        PKCS12_free(p12);
+    }
     
     fclose(p12FilePtr);
     fclose(certFilePtr);
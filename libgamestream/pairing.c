@@ -21,12 +21,12 @@
 #include "mkcert.h"
 #include "pairing.h"
 #include "errors.h"
+#include "hex.h"
 
 #include <sys/stat.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
-#include <openssl/sha.h>
 #include <openssl/aes.h>
 #include <openssl/rand.h>
 #include <openssl/evp.h>
@@ -70,171 +70,284 @@ static int xml_search(char* data, size_t len, char* node, char** result) {
     return GS_OK;
 }
 
-static void bytes_to_hex(unsigned char *in, char *out, size_t len) {
-    for (int i = 0; i < len; i++) {
-        sprintf(out + i * 2, "%02x", in[i]);
-    }
-    out[len * 2] = 0;
-}
-
-static int sign_it(const unsigned char *msg, size_t mlen, unsigned char **sig, size_t *slen, EVP_PKEY *pkey) {
-    int result = GS_FAILED;
-    
+static int sign_it(EVP_MD_CTX *ctx, const unsigned char *msg, size_t mlen, unsigned char **sig, size_t *slen) {
     *sig = NULL;
     *slen = 0;
     
-    EVP_MD_CTX *ctx = EVP_MD_CTX_create();
-    if (ctx == NULL)
-        return GS_FAILED;
-    
-    const EVP_MD *md = EVP_get_digestbyname("SHA256");
-    if (md == NULL)
-        goto cleanup;
-    
-    int rc = EVP_DigestInit_ex(ctx, md, NULL);
-    if (rc != 1)
-        goto cleanup;
-    
-    rc = EVP_DigestSignInit(ctx, NULL, md, NULL, pkey);
-    if (rc != 1)
-        goto cleanup;
-    
-    rc = EVP_DigestSignUpdate(ctx, msg, mlen);
+    int rc = EVP_DigestSignUpdate(ctx, msg, mlen);
     if (rc != 1)
-        goto cleanup;
+        return GS_FAILED;
     
     size_t req = 0;
     rc = EVP_DigestSignFinal(ctx, NULL, &req);
     if (rc != 1 || !(req > 0))
-        goto cleanup;
+        return GS_FAILED;
     
     *sig = OPENSSL_malloc(req);
     if (*sig == NULL)
-        goto cleanup;
+        return GS_OUT_OF_MEMORY;
     
     *slen = req;
     rc = EVP_DigestSignFinal(ctx, *sig, slen);
-    if (rc != 1 || req != *slen)
-        goto cleanup;
-    
-    result = GS_OK;
-    
-cleanup:
-    EVP_MD_CTX_destroy(ctx);
-    ctx = NULL;
+    if (rc != 1 || req != *slen) {
+        OPENSSL_free(*sig);
+        *sig = NULL;
+        return GS_FAILED;
+    }
     
-    return result;
+    return GS_OK;
 }
 
-int gs_pair(int serverMajorVersion, const char* address, const char* pin) {
-    int ret = GS_OK;
+// How long each request may take before the step fails. The first request
+// doesn't complete until the user enters the PIN on the host.
+static const long k_StepTimeoutSecs[PAIR_STEP_COMPLETE] = { 300, 10, 10, 10 };
+
+static const char* k_StepNames[PAIR_STEP_COMPLETE + 1] = {
+    "getservercert", "clientchallenge", "serverchallengeresp", "clientpairingsecret", "complete"
+};
+
+// Crypto state set up once per pairing attempt and shared by all steps
+typedef struct _PAIR_CRYPTO {
+    // SHA-256 for server major version 7 and later, SHA-1 before that
+    const EVP_MD *hash_md;
+    int hash_length;
+    AES_KEY enc_key, dec_key;
+    // SHA-256 signing context bound to the client private key
+    EVP_MD_CTX *sign_ctx;
+} PAIR_CRYPTO;
+
+struct _PAIR_STATE {
+    int step;
+    int serverMajorVersion;
+    char* address;
+    char pin[4];
+    volatile int cancelled;
+    
+    PHTTP_DATA data;
     char url[4096];
     
+    PAIR_CRYPTO crypto;
     unsigned char salt_data[16];
+    unsigned char client_secret_data[16];
+    unsigned char challenge_response_hash_enc[32];
+};
+
+static int pair_request(PPAIR_STATE state) {
+    return http_request_cancellable(state->url, state->data, k_StepTimeoutSecs[state->step], &state->cancelled);
+}
+
+static int pair_get_server_cert(PPAIR_STATE state) {
+    int ret;
     char salt_hex[33];
-    RAND_bytes(salt_data, 16);
-    bytes_to_hex(salt_data, salt_hex, 16);
     
-    sprintf(url, "http://%s:47989/pair?uniqueid=%s&devicename=roth&updateState=1&phrase=getservercert&salt=%s&clientcert=%s", address, g_UniqueId, salt_hex, g_CertHex);
-    PHTTP_DATA data = http_create_data();
-    if (data == NULL)
-        return GS_OUT_OF_MEMORY;
-    else if ((ret = http_request(url, data)) != GS_OK)
-        goto cleanup;
+    RAND_bytes(state->salt_data, 16);
+    hex_encode(state->salt_data, salt_hex, 16);
+    
+    sprintf(state->url, "http://%s:47989/pair?uniqueid=%s&devicename=roth&updateState=1&phrase=getservercert&salt=%s&clientcert=%s", state->address, g_UniqueId, salt_hex, g_CertHex);
+    if ((ret = pair_request(state)) != GS_OK)
+        return ret;
     
     unsigned char salt_pin[20];
     unsigned char aes_key_hash[32];
-    AES_KEY enc_key, dec_key;
-    memcpy(salt_pin, salt_data, 16);
-    memcpy(salt_pin+16, pin, 4);
+    memcpy(salt_pin, state->salt_data, 16);
+    memcpy(salt_pin+16, state->pin, 4);
     
-    int hash_length = serverMajorVersion >= 7 ? 32 : 20;
-    if (serverMajorVersion >= 7)
-        SHA256(salt_pin, 20, aes_key_hash);
-    else
-        SHA1(salt_pin, 20, aes_key_hash);
+    if (!EVP_Digest(salt_pin, 20, aes_key_hash, NULL, state->crypto.hash_md, NULL))
+        return GS_FAILED;
     
-    AES_set_encrypt_key((unsigned char *)aes_key_hash, 128, &enc_key);
-    AES_set_decrypt_key((unsigned char *)aes_key_hash, 128, &dec_key);
+    AES_set_encrypt_key((unsigned char *)aes_key_hash, 128, &state->crypto.enc_key);
+    AES_set_decrypt_key((unsigned char *)aes_key_hash, 128, &state->crypto.dec_key);
     
+    return GS_OK;
+}
+
+static int pair_send_client_challenge(PPAIR_STATE state) {
+    int ret;
     unsigned char challenge_data[16];
     unsigned char challenge_enc[16];
     char challenge_hex[33];
     RAND_bytes(challenge_data, 16);
-    AES_encrypt(challenge_data, challenge_enc, &enc_key);
-    bytes_to_hex(challenge_enc, challenge_hex, 16);
+    AES_encrypt(challenge_data, challenge_enc, &state->crypto.enc_key);
+    hex_encode(challenge_enc, challenge_hex, 16);
     
-    sprintf(url, "http://%s:47989/pair?uniqueid=%s&devicename=roth&updateState=1&clientchallenge=%s", address, g_UniqueId, challenge_hex);
-    if ((ret = http_request(url, data)) != GS_OK)
-        goto cleanup;
+    sprintf(state->url, "http://%s:47989/pair?uniqueid=%s&devicename=roth&updateState=1&clientchallenge=%s", state->address, g_UniqueId, challenge_hex);
+    if ((ret = pair_request(state)) != GS_OK)
+        return ret;
     
     char *result;
-    if (xml_search(data->memory, data->size, "challengeresponse", &result) != GS_OK) {
-        ret = GS_INVALID;
-        goto cleanup;
-    }
+    if (xml_search(state->data->memory, state->data->size, "challengeresponse", &result) != GS_OK)
+        return GS_INVALID;
     
     unsigned char challenge_response_data_enc[48];
     unsigned char challenge_response_data[48];
-    for (int count = 0; count < strlen(result); count += 2) {
-        sscanf(&result[count], "%2hhx", &challenge_response_data_enc[count / 2]);
+    if (strlen(result) != sizeof(challenge_response_data_enc) * 2 ||
+        hex_decode(result, challenge_response_data_enc, strlen(result)) != GS_OK) {
+        free(result);
+        return GS_INVALID;
     }
     free(result);
     
     for (int i = 0; i < 48; i += 16) {
-        AES_decrypt(&challenge_response_data_enc[i], &challenge_response_data[i], &dec_key);
+        AES_decrypt(&challenge_response_data_enc[i], &challenge_response_data[i], &state->crypto.dec_key);
     }
     
-    unsigned char client_secret_data[16];
-    RAND_bytes(client_secret_data, 16);
+    RAND_bytes(state->client_secret_data, 16);
     
     unsigned char challenge_response[16 + 256 + 16];
     unsigned char challenge_response_hash[32];
-    unsigned char challenge_response_hash_enc[32];
-    char challenge_response_hex[65];
-    memcpy(challenge_response, challenge_response_data + hash_length, 16);
+    memcpy(challenge_response, challenge_response_data + state->crypto.hash_length, 16);
     memcpy(challenge_response + 16, g_Cert->signature->data, 256);
-    memcpy(challenge_response + 16 + 256, client_secret_data, 16);
+    memcpy(challenge_response + 16 + 256, state->client_secret_data, 16);
     
-    if (serverMajorVersion >= 7)
-        SHA256(challenge_response, 16 + 256 + 16, challenge_response_hash);
-    else
-        SHA1(challenge_response, 16 + 256 + 16, challenge_response_hash);
+    if (!EVP_Digest(challenge_response, 16 + 256 + 16, challenge_response_hash, NULL, state->crypto.hash_md, NULL))
+        return GS_FAILED;
     
     for (int i = 0; i < 32; i += 16) {
-        AES_encrypt(&challenge_response_hash[i], &challenge_response_hash_enc[i], &enc_key);
+        AES_encrypt(&challenge_response_hash[i], &state->challenge_response_hash_enc[i], &state->crypto.enc_key);
     }
-    bytes_to_hex(challenge_response_hash_enc, challenge_response_hex, 32);
     
-    sprintf(url, "http://%s:47989/pair?uniqueid=%s&devicename=roth&updateState=1&serverchallengeresp=%s", address, g_UniqueId, challenge_response_hex);
-    if ((ret = http_request(url, data)) != GS_OK)
-        goto cleanup;
+    return GS_OK;
+}
+
+static int pair_send_server_challenge_resp(PPAIR_STATE state) {
+    int ret;
+    char challenge_response_hex[65];
+    hex_encode(state->challenge_response_hash_enc, challenge_response_hex, 32);
     
-    if (xml_search(data->memory, data->size, "pairingsecret", &result) != GS_OK) {
-        ret = GS_INVALID;
-        goto cleanup;
-    }
+    sprintf(state->url, "http://%s:47989/pair?uniqueid=%s&devicename=roth&updateState=1&serverchallengeresp=%s", state->address, g_UniqueId, challenge_response_hex);
+    if ((ret = pair_request(state)) != GS_OK)
+        return ret;
+    
+    char *result;
+    if (xml_search(state->data->memory, state->data->size, "pairingsecret", &result) != GS_OK)
+        return GS_INVALID;
+    free(result);
     
+    return GS_OK;
+}
+
+static int pair_send_client_pairing_secret(PPAIR_STATE state) {
     unsigned char *signature = NULL;
     size_t s_len;
-    if (sign_it(client_secret_data, 16, &signature, &s_len, g_PrivateKey) != GS_OK) {
+    if (sign_it(state->crypto.sign_ctx, state->client_secret_data, 16, &signature, &s_len) != GS_OK) {
         gs_error = "Failed to sign data";
-        ret = GS_FAILED;
-        goto cleanup;
+        return GS_FAILED;
     }
     
     unsigned char client_pairing_secret[16 + 256];
     char client_pairing_secret_hex[(16 + 256) * 2 + 1];
-    memcpy(client_pairing_secret, client_secret_data, 16);
+    memcpy(client_pairing_secret, state->client_secret_data, 16);
     memcpy(client_pairing_secret + 16, signature, 256);
-    bytes_to_hex(client_pairing_secret, client_pairing_secret_hex, 16 + 256);
+    hex_encode(client_pairing_secret, client_pairing_secret_hex, 16 + 256);
+    OPENSSL_free(signature);
     
-    sprintf(url, "http://%s:47989/pair?uniqueid=%s&devicename=roth&updateState=1&clientpairingsecret=%s", address, g_UniqueId, client_pairing_secret_hex);
-    if ((ret = http_request(url, data)) != GS_OK)
-        goto cleanup;
+    sprintf(state->url, "http://%s:47989/pair?uniqueid=%s&devicename=roth&updateState=1&clientpairingsecret=%s", state->address, g_UniqueId, client_pairing_secret_hex);
+    return pair_request(state);
+}
+
+PPAIR_STATE gs_pair_create(int serverMajorVersion, const char* address, const char* pin) {
+    PPAIR_STATE state = calloc(1, sizeof(*state));
+    if (state == NULL)
+        return NULL;
+    
+    state->step = PAIR_STEP_GET_SERVER_CERT;
+    state->serverMajorVersion = serverMajorVersion;
+    memcpy(state->pin, pin, 4);
+    state->address = strdup(address);
+    state->data = http_create_data();
+    if (state->address == NULL || state->data == NULL) {
+        gs_pair_free(state);
+        return NULL;
+    }
     
-cleanup:
-    http_free_data(data);
+    return state;
+}
+
+// Sets up the crypto state on the thread that runs the steps. Binding the
+// signing context takes a reference on g_PrivateKey, which the HTTPS code
+// also does, and OpenSSL has no locking callbacks installed to make that safe
+// across threads.
+static int pair_crypto_init(PPAIR_STATE state) {
+    state->crypto.hash_md = state->serverMajorVersion >= 7 ? EVP_sha256() : EVP_sha1();
+    state->crypto.hash_length = EVP_MD_size(state->crypto.hash_md);
+    
+    state->crypto.sign_ctx = EVP_MD_CTX_create();
+    if (state->crypto.sign_ctx == NULL ||
+        EVP_DigestSignInit(state->crypto.sign_ctx, NULL, EVP_sha256(), NULL, g_PrivateKey) != 1)
+        return GS_FAILED;
+    
+    return GS_OK;
+}
+
+void gs_pair_finish(PPAIR_STATE state) {
+    if (state->crypto.sign_ctx != NULL)
+        EVP_MD_CTX_destroy(state->crypto.sign_ctx);
+    memset(&state->crypto, 0, sizeof(state->crypto));
+}
+
+int gs_pair_step(PPAIR_STATE state) {
+    int ret;
+    
+    if (state->cancelled)
+        return GS_CANCELLED;
+    
+    if (state->step == PAIR_STEP_GET_SERVER_CERT && state->crypto.sign_ctx == NULL &&
+        (ret = pair_crypto_init(state)) != GS_OK)
+        return ret;
+    
+    switch (state->step) {
+        case PAIR_STEP_GET_SERVER_CERT:
+            ret = pair_get_server_cert(state);
+            break;
+        case PAIR_STEP_CLIENT_CHALLENGE:
+            ret = pair_send_client_challenge(state);
+            break;
+        case PAIR_STEP_SERVER_CHALLENGE_RESP:
+            ret = pair_send_server_challenge_resp(state);
+            break;
+        case PAIR_STEP_CLIENT_PAIRING_SECRET:
+            ret = pair_send_client_pairing_secret(state);
+            break;
+        default:
+            return GS_WRONG_STATE;
+    }
+    
+    if (ret == GS_OK)
+        state->step++;
     
     return ret;
-}
\ No newline at end of file
+}
+
+int gs_pair_get_step(PPAIR_STATE state) {
+    return state->step;
+}
+
+const char* gs_pair_step_name(int step) {
+    return k_StepNames[step];
+}
+
+void gs_pair_cancel(PPAIR_STATE state) {
+    state->cancelled = 1;
+}
+
+void gs_pair_free(PPAIR_STATE state) {
+    gs_pair_finish(state);
+    http_free_data(state->data);
+    free(state->address);
+    free(state);
+}
+
+int gs_pair(int serverMajorVersion, const char* address, const char* pin) {
+    int ret = GS_OK;
+    PPAIR_STATE state = gs_pair_create(serverMajorVersion, address, pin);
+    if (state == NULL)
+        return GS_OUT_OF_MEMORY;
+    
+    while (ret == GS_OK && state->step != PAIR_STEP_COMPLETE) {
+        ret = gs_pair_step(state);
+    }
+    
+    gs_pair_free(state);
+    
+    return ret;
+}
@@ -23,8 +23,33 @@
 extern "C" {
 #endif
 
+// Steps of the pairing handshake in the order they are performed
+#define PAIR_STEP_GET_SERVER_CERT 0
+#define PAIR_STEP_CLIENT_CHALLENGE 1
+#define PAIR_STEP_SERVER_CHALLENGE_RESP 2
+#define PAIR_STEP_CLIENT_PAIRING_SECRET 3
+#define PAIR_STEP_COMPLETE 4
+
+typedef struct _PAIR_STATE PAIR_STATE, *PPAIR_STATE;
+
+// Pairs synchronously by running each step in turn
 int gs_pair(int serverMajorVersion, const char* address, const char* pin);
 
+// Pairs one request at a time so the caller can interleave other work
+// between steps. gs_pair_step() performs the current step and advances
+// to the next one on success. gs_pair_cancel() may be called from any
+// thread and aborts the request in progress with GS_CANCELLED.
+// gs_pair_create() allocates no crypto state; the first step sets it up and
+// gs_pair_finish() releases it, so both happen on the thread running the
+// steps. gs_pair_free() then releases what's left from any thread.
+PPAIR_STATE gs_pair_create(int serverMajorVersion, const char* address, const char* pin);
+int gs_pair_step(PPAIR_STATE state);
+void gs_pair_finish(PPAIR_STATE state);
+int gs_pair_get_step(PPAIR_STATE state);
+const char* gs_pair_step_name(int step);
+void gs_pair_cancel(PPAIR_STATE state);
+void gs_pair_free(PPAIR_STATE state);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
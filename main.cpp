@@ -2,10 +2,12 @@
 
 #include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <pairing.h>
+#include <errors.h>
 
 #include "ppapi/cpp/input_event.h"
 
@@ -18,6 +20,13 @@
 
 #define MSG_OPENURL "openUrl"
 
+// Video packet payload sizes accepted from the page. The default is safe
+// across VPNs and tunnels. The maximum leaves a 9000 byte jumbo frame the
+// same 108 bytes of header room that 1392 leaves in a 1500 byte MTU.
+#define DEFAULT_PACKET_SIZE 1024
+#define MIN_PACKET_SIZE 256
+#define MAX_PACKET_SIZE 8892
+
 MoonlightInstance* g_Instance;
 
 MoonlightInstance::~MoonlightInstance() {}
@@ -142,9 +151,11 @@ void MoonlightInstance::HandleMessage(const pp::Var& var_message) {
     } else if (strcmp(method.c_str(), "httpInit") == 0) {
         NvHTTPInit(callbackId, params);
     } else if (strcmp(method.c_str(), "makeCert") == 0) {
-        MakeCert(callbackId, params);
+        HandleMakeCert(callbackId, params);
     } else if (strcmp(method.c_str(), "pair") == 0) {
         HandlePair(callbackId, params);
+    } else if (strcmp(method.c_str(), "cancelPair") == 0) {
+        HandleCancelPair(callbackId, params);
     } else {
         pp::Var response("Unhandled message received: " + method);
         PostMessage(response);
@@ -159,6 +170,25 @@ void MoonlightInstance::HandleStartStream(int32_t callbackId, pp::VarArray args)
     std::string bitrate = args.Get(4).AsString();
     std::string serverMajorVersion = args.Get(5).AsString();
     
+    // The packet size is optional for older callers
+    int packetSize = DEFAULT_PACKET_SIZE;
+    if (args.GetLength() > 6) {
+        std::string packetSizeStr = args.Get(6).AsString();
+        char* end;
+        long value = strtol(packetSizeStr.c_str(), &end, 10);
+        
+        // Unparseable values fall back to the default; others are clamped
+        if (!packetSizeStr.empty() && *end == '\0') {
+            if (value < MIN_PACKET_SIZE) {
+                value = MIN_PACKET_SIZE;
+            }
+            else if (value > MAX_PACKET_SIZE) {
+                value = MAX_PACKET_SIZE;
+            }
+            packetSize = (int)value;
+        }
+    }
+    
     pp::Var response("Setting stream width to: " + width);
     PostMessage(response);
     response = ("Setting stream height to: " + height);
@@ -171,13 +201,15 @@ void MoonlightInstance::HandleStartStream(int32_t callbackId, pp::VarArray args)
     PostMessage(response);
     response = ("Setting server major version to: " + serverMajorVersion);
     PostMessage(response);
+    response = ("Setting video packet size to: " + std::to_string(packetSize));
+    PostMessage(response);
     
     // Populate the stream configuration
     m_StreamConfig.width = stoi(width);
     m_StreamConfig.height = stoi(height);
     m_StreamConfig.fps = stoi(fps);
     m_StreamConfig.bitrate = stoi(bitrate); // kilobits per second
-    m_StreamConfig.packetSize = 1024;
+    m_StreamConfig.packetSize = packetSize;
     m_StreamConfig.streamingRemotely = 0;
     m_StreamConfig.audioConfiguration = AUDIO_CONFIGURATION_STEREO;
     
@@ -218,18 +250,106 @@ void MoonlightInstance::HandleOpenURL(int32_t callbackId, pp::VarArray args) {
     PostMessage(pp::Var (url.c_str()));
 }
 
+void MoonlightInstance::HandleMakeCert(int32_t callbackId, pp::VarArray args) {
+    // Generating the RSA key takes long enough to visibly hang the UI,
+    // so do it off the main thread and resolve the promise from there.
+    openHttpThread.message_loop().PostWork(m_CallbackFactory.NewCallback(&MoonlightInstance::MakeCert, callbackId, args));
+}
+
 void MoonlightInstance::HandlePair(int32_t callbackId, pp::VarArray args) {
-     openHttpThread.message_loop().PostWork(m_CallbackFactory.NewCallback(&MoonlightInstance::PairCallback, callbackId, args));
+    if (m_PairState != NULL) {
+        // The previous attempt may still be waiting on an HTTP request
+        // after being cancelled. The page only shows the newest PIN, so
+        // make sure the old attempt stops, and start this one when it has.
+        gs_pair_cancel(m_PairState);
+        CancelPendingPair();
+        m_PairPending = true;
+        m_PendingPairCallbackId = callbackId;
+        m_PendingPairArgs = args;
+        return;
+    }
+    
+    m_PairState = gs_pair_create(atoi(args.Get(0).AsString().c_str()), args.Get(1).AsString().c_str(), args.Get(2).AsString().c_str());
+    if (m_PairState == NULL) {
+        PairFinished(PP_OK, callbackId, GS_OUT_OF_MEMORY);
+        return;
+    }
+    
+    openHttpThread.message_loop().PostWork(m_CallbackFactory.NewCallback(&MoonlightInstance::PairCallback, callbackId));
+}
+
+void MoonlightInstance::CancelPendingPair(void) {
+    if (!m_PairPending) {
+        return;
+    }
+    m_PairPending = false;
+    
+    pp::VarDictionary ret;
+    ret.Set("callbackId", pp::Var(m_PendingPairCallbackId));
+    ret.Set("type", pp::Var("resolve"));
+    ret.Set("ret", pp::Var(GS_CANCELLED));
+    PostMessage(ret);
 }
 
-void MoonlightInstance::PairCallback(int32_t /*result*/, int32_t callbackId, pp::VarArray args) {
-    int err = gs_pair(atoi(args.Get(0).AsString().c_str()), args.Get(1).AsString().c_str(), args.Get(2).AsString().c_str());
+void MoonlightInstance::HandleCancelPair(int32_t callbackId, pp::VarArray args) {
+    // The pairing state is only freed on the main thread, so it's
+    // safe to flag it here while a step is running on the HTTP thread.
+    if (m_PairState != NULL) {
+        gs_pair_cancel(m_PairState);
+    }
+    
+    // A queued attempt is the one the page is showing, so it goes too
+    CancelPendingPair();
+    
+    pp::VarDictionary ret;
+    ret.Set("callbackId", pp::Var(callbackId));
+    ret.Set("type", pp::Var("resolve"));
+    ret.Set("ret", pp::VarDictionary());
+    PostMessage(ret);
+}
+
+void MoonlightInstance::PairCallback(int32_t /*result*/, int32_t callbackId) {
+    int step = gs_pair_get_step(m_PairState);
+    PP_TimeTicks start = pp::Module::Get()->core()->GetTimeTicks();
+    
+    int err = gs_pair_step(m_PairState);
+    
+    int elapsedMs = (int)((pp::Module::Get()->core()->GetTimeTicks() - start) * 1000);
+    PostMessage(pp::Var(std::string("Pairing step ") + gs_pair_step_name(step) +
+                        " took " + std::to_string(elapsedMs) + " ms"));
+    
+    if (err == GS_OK && gs_pair_get_step(m_PairState) != PAIR_STEP_COMPLETE) {
+        // Queue the next step behind any other pending HTTP requests
+        // rather than holding the HTTP thread for the whole handshake.
+        openHttpThread.message_loop().PostWork(m_CallbackFactory.NewCallback(&MoonlightInstance::PairCallback, callbackId));
+        return;
+    }
+    
+    // Release the crypto state here on the HTTP thread, where it was
+    // created, so it never races the HTTPS code's use of the private key.
+    // The rest of the state is freed on the main thread.
+    gs_pair_finish(m_PairState);
+    
+    pp::Module::Get()->core()->CallOnMainThread(0,
+        m_CallbackFactory.NewCallback(&MoonlightInstance::PairFinished, callbackId, err));
+}
+
+void MoonlightInstance::PairFinished(int32_t /*result*/, int32_t callbackId, int err) {
+    if (m_PairState != NULL) {
+        gs_pair_free(m_PairState);
+        m_PairState = NULL;
+    }
     
     pp::VarDictionary ret;
     ret.Set("callbackId", pp::Var(callbackId));
     ret.Set("type", pp::Var("resolve"));
     ret.Set("ret", pp::Var(err));
     PostMessage(ret);
+    
+    if (m_PairPending) {
+        m_PairPending = false;
+        HandlePair(m_PendingPairCallbackId, m_PendingPairArgs);
+    }
 }
 
 bool MoonlightInstance::Init(uint32_t argc,
@@ -7,6 +7,7 @@
 #include "ppapi/cpp/video_decoder.h"
 #include "ppapi/cpp/audio.h"
 #include "ppapi/cpp/text_input_controller.h"
+#include "ppapi/cpp/view.h"
 
 #include "ppapi/c/ppb_gamepad.h"
 #include "ppapi/c/pp_input_event.h"
@@ -28,12 +29,18 @@
 
 #include <opus_multistream.h>
 
+#include <pairing.h>
+
 struct Shader {
-  Shader() : program(0), texcoord_scale_location(0) {}
+  Shader() : program(0), texcoord_scale_location(0), texcoord_scale_x(0), texcoord_scale_y(0) {}
   ~Shader() {}
 
   GLuint program;
   GLint texcoord_scale_location;
+  
+  // Last v_scale value loaded into the program
+  GLfloat texcoord_scale_x;
+  GLfloat texcoord_scale_y;
 };
 
 class MoonlightInstance : public pp::Instance, public pp::MouseLock {
@@ -42,13 +49,21 @@ class MoonlightInstance : public pp::Instance, public pp::MouseLock {
             pp::Instance(instance),
             pp::MouseLock(this),
             m_IsPainting(false),
-            m_RequestIdrFrame(false),
+            m_ViewWidth(0),
+            m_ViewHeight(0),
+            m_ViewChanged(false),
             m_OpusDecoder(NULL),
             m_CallbackFactory(this),
             m_MouseLocked(false),
             m_KeyModifiers(0),
             m_WaitingForAllModifiersUp(false),
             m_AccumulatedTicks(0),
+            m_MouseDeltaX(0),
+            m_MouseDeltaY(0),
+            m_MouseMoveFlushPending(false),
+            m_PairState(NULL),
+            m_PairPending(false),
+            m_PendingPairCallbackId(0),
             openHttpThread(this) {
             // This function MUST be used otherwise sockets don't work (nacl_io_init() doesn't work!)            
             nacl_io_init_ppapi(pp_instance(), pp::Module::Get()->get_browser_interface());
@@ -68,11 +83,15 @@ class MoonlightInstance : public pp::Instance, public pp::MouseLock {
         
         void HandleMessage(const pp::Var& var_message);
         void HandlePair(int32_t callbackId, pp::VarArray args);
+        void HandleCancelPair(int32_t callbackId, pp::VarArray args);
         void HandleShowGames(int32_t callbackId, pp::VarArray args);
         void HandleStartStream(int32_t callbackId, pp::VarArray args);
         void HandleStopStream(int32_t callbackId, pp::VarArray args);
         void HandleOpenURL(int32_t callbackId, pp::VarArray args);
-        void PairCallback(int32_t /*result*/, int32_t callbackId, pp::VarArray args);
+        void HandleMakeCert(int32_t callbackId, pp::VarArray args);
+        void PairCallback(int32_t /*result*/, int32_t callbackId);
+        void PairFinished(int32_t /*result*/, int32_t callbackId, int err);
+        void CancelPendingPair(void);
     
         void UpdateModifiers(PP_InputEvent_Type eventType, short keyCode);
         bool HandleInputEvent(const pp::InputEvent& event);
@@ -80,8 +99,11 @@ class MoonlightInstance : public pp::Instance, public pp::MouseLock {
         void PollGamepads();
         
         void MouseLockLost();
+        void SendPendingMouseMovement(int32_t unused);
         void DidLockMouse(int32_t result);
         void DidChangeFocus(bool got_focus);
+        void DidChangeView(const pp::View& view);
+        void SkipStalledPictures();
         
         void OnConnectionStopped(uint32_t unused);
         void OnConnectionStarted(uint32_t error);
@@ -99,6 +121,7 @@ class MoonlightInstance : public pp::Instance, public pp::MouseLock {
         static void ClDisplayTransientMessage(char* message);
         
         static Shader CreateProgram(const char* vertexShader, const char* fragmentShader);
+        static void SetTexcoordScale(Shader* shader, GLfloat x, GLfloat y);
         static void CreateShader(GLuint program, GLenum type, const char* source, int size);
         
         void PaintFinished(int32_t result);
@@ -106,6 +129,7 @@ class MoonlightInstance : public pp::Instance, public pp::MouseLock {
         void PictureReady(int32_t result, PP_VideoPicture picture);
         void PaintPicture(void);
         void InitializeRenderingSurface(int width, int height);
+        void ResizeRenderingSurface();
         
         static void VidDecSetup(int videoFormat, int width, int height, int redrawRate, void* context, int drFlags);
         static void VidDecCleanup(void);
@@ -115,7 +139,7 @@ class MoonlightInstance : public pp::Instance, public pp::MouseLock {
         static void AudDecCleanup(void);
         static void AudDecDecodeAndPlaySample(char* sampleData, int sampleLength);
         
-        void MakeCert(int32_t callbackId, pp::VarArray args);
+        void MakeCert(int32_t /*result*/, int32_t callbackId, pp::VarArray args);
         void LoadCert(const char* certStr, const char* keyStr);
         
         void NvHTTPInit(int32_t callbackId, pp::VarArray args);
@@ -141,7 +165,9 @@ class MoonlightInstance : public pp::Instance, public pp::MouseLock {
         Shader m_ExternalOesShader;
         std::queue<PP_VideoPicture> m_PendingPictureQueue;
         bool m_IsPainting;
-        bool m_RequestIdrFrame;
+        int m_ViewWidth;
+        int m_ViewHeight;
+        bool m_ViewChanged;
         
         OpusMSDecoder* m_OpusDecoder;
         pp::Audio m_AudioPlayer;
@@ -153,7 +179,14 @@ class MoonlightInstance : public pp::Instance, public pp::MouseLock {
         char m_KeyModifiers;
         bool m_WaitingForAllModifiersUp;
         float m_AccumulatedTicks;
+        int m_MouseDeltaX;
+        int m_MouseDeltaY;
+        bool m_MouseMoveFlushPending;
     
+        PPAIR_STATE m_PairState;
+        bool m_PairPending;
+        int32_t m_PendingPairCallbackId;
+        pp::VarArray m_PendingPairArgs;
         pp::SimpleThread openHttpThread;
 };
 
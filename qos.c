@@ -0,0 +1,95 @@
+#include "qos.h"
+
+// Windows in a row that must look congested before backing off, and
+// clean before probing upwards again
+#define CONGESTED_WINDOWS_TO_LOWER 3
+#define CLEAN_WINDOWS_TO_RAISE 10
+
+// More than this fraction of frames lost (in percent) is congestion
+#define MAX_LOSS_PERCENT 2
+
+// Windows carrying less than this fraction of the stream frame rate (in
+// percent) are too sparse for their arrival jitter to mean anything
+#define MIN_JITTER_FRAME_RATE_PERCENT 50
+
+// Step sizes, in percent of the current bitrate
+#define LOWER_STEP_PERCENT 30
+#define RAISE_STEP_PERCENT 10
+
+// Below this fraction of the starting bitrate (in percent), the
+// resolution is too high for the link
+#define MIN_BITRATE_PERCENT 25
+
+void QosInit(PQOS_CONTROLLER qos, int bitrate, int fps) {
+    qos->fps = fps;
+    qos->maxBitrate = bitrate;
+    qos->minBitrate = bitrate * MIN_BITRATE_PERCENT / 100;
+    qos->bitrate = bitrate;
+    qos->congestedWindows = 0;
+    qos->cleanWindows = 0;
+}
+
+static int IsCongested(PQOS_CONTROLLER qos, const QOS_SAMPLE* sample) {
+    int fps = qos->fps > 0 ? qos->fps : 60;
+    int frameIntervalUs = 1000000 / fps;
+    int frames = sample->framesReceived + sample->framesLost;
+    
+    // Losing frames means the link or the host's encoder can't keep up
+    if (frames > 0 && sample->framesLost * 100 > frames * MAX_LOSS_PERCENT) {
+        return 1;
+    }
+    
+    // Frames arriving a whole interval off schedule are queueing somewhere.
+    // When the host is sending far fewer frames than the stream rate
+    // (static content, a capped game), uneven gaps are just its pacing.
+    if (frames * 1000LL * 100 >= (long long)fps * sample->windowMs * MIN_JITTER_FRAME_RATE_PERCENT &&
+        sample->jitterUs > frameIntervalUs) {
+        return 1;
+    }
+    
+    // A decoder that can't finish a frame per interval falls behind no
+    // matter what the network does
+    if (sample->decodeTimeUs > frameIntervalUs) {
+        return 1;
+    }
+    
+    return 0;
+}
+
+int QosUpdate(PQOS_CONTROLLER qos, const QOS_SAMPLE* sample) {
+    // Ignore windows with nothing in them (e.g. while the host is paused)
+    if (sample->windowMs <= 0 || sample->framesReceived + sample->framesLost == 0) {
+        return QOS_HOLD;
+    }
+    
+    if (IsCongested(qos, sample)) {
+        qos->cleanWindows = 0;
+        if (++qos->congestedWindows < CONGESTED_WINDOWS_TO_LOWER) {
+            return QOS_HOLD;
+        }
+        qos->congestedWindows = 0;
+        
+        if (qos->bitrate <= qos->minBitrate) {
+            // Already as low as this resolution sensibly goes
+            return QOS_LOWER_RESOLUTION;
+        }
+        
+        qos->bitrate -= qos->bitrate * LOWER_STEP_PERCENT / 100;
+        if (qos->bitrate < qos->minBitrate) {
+            qos->bitrate = qos->minBitrate;
+        }
+        return QOS_LOWER_BITRATE;
+    }
+    
+    qos->congestedWindows = 0;
+    if (qos->bitrate >= qos->maxBitrate || ++qos->cleanWindows < CLEAN_WINDOWS_TO_RAISE) {
+        return QOS_HOLD;
+    }
+    qos->cleanWindows = 0;
+    
+    qos->bitrate += qos->bitrate * RAISE_STEP_PERCENT / 100;
+    if (qos->bitrate > qos->maxBitrate) {
+        qos->bitrate = qos->maxBitrate;
+    }
+    return QOS_RAISE_BITRATE;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Link statistics gathered over one sample window
+typedef struct _QOS_SAMPLE {
+    // Length of the window in milliseconds
+    int windowMs;
+    
+    // Frames handed to the decoder and frames lost or dropped
+    int framesReceived;
+    int framesLost;
+    
+    // Average decode time and standard deviation of frame
+    // inter-arrival times about their mean for the window,
+    // in microseconds
+    int decodeTimeUs;
+    int jitterUs;
+} QOS_SAMPLE, *PQOS_SAMPLE;
+
+#define QOS_HOLD               0
+#define QOS_LOWER_BITRATE      1
+#define QOS_RAISE_BITRATE      2
+#define QOS_LOWER_RESOLUTION   3
+
+typedef struct _QOS_CONTROLLER {
+    int fps;
+    int maxBitrate;
+    int minBitrate;
+    int bitrate;
+    int congestedWindows;
+    int cleanWindows;
+} QOS_CONTROLLER, *PQOS_CONTROLLER;
+
+// Starts a controller for a stream at the given bitrate (Kbps) and frame rate
+void QosInit(PQOS_CONTROLLER qos, int bitrate, int fps);
+
+// Feeds one sample window to the controller. Returns one of the QOS_*
+// decisions; the recommended bitrate is then in qos->bitrate.
+// This has no side effects beyond the controller state so it can be
+// replayed against recorded statistics.
+int QosUpdate(PQOS_CONTROLLER qos, const QOS_SAMPLE* sample);
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,6 +3,7 @@ var hosts = [];
 var pairingCert;
 var myUniqueid;
 var api;
+var packetSizeOverride; // set in chrome.storage.sync to force a video packet size
 
 // Called by the common.js module.
 function attachListeners() {
@@ -138,6 +139,7 @@ function pairPushed() {
 
 function pairingPopupCanceled() {
     document.querySelector('#pairingDialog').close();
+    sendMessage('cancelPair', []);
 }
 
 // someone pushed the "show apps" button. 
@@ -232,14 +234,15 @@ function startSelectedGame() {
         var streamHeight = $('#selectResolution option:selected').val().split(':')[1];
         // we told the user it was in Mbps. We're dirty liars and use Kbps behind their back.
         var bitrate = parseInt($("#bitrateSlider").val()) * 1024;
-        console.log('startRequest:' + target + ":" + streamWidth + ":" + streamHeight + ":" + frameRate + ":" + bitrate);
+        var packetSize = getPacketSize(target);
+        console.log('startRequest:' + target + ":" + streamWidth + ":" + streamHeight + ":" + frameRate + ":" + bitrate + ":" + packetSize);
 
         var rikey = '00000000000000000000000000000000';
         var rikeyid = 0;
 
         if(api.currentGame == appID) // if user wants to launch the already-running app, then we resume it.
             return api.resumeApp(rikey, rikeyid).then(function (ret) {
-                sendMessage('startRequest', [target, streamWidth, streamHeight, frameRate, bitrate.toString(), api.serverMajorVersion.toString()]);
+                sendMessage('startRequest', [target, streamWidth, streamHeight, frameRate, bitrate.toString(), api.serverMajorVersion.toString(), packetSize.toString()]);
             });
 
         api.launchApp(appID,
@@ -249,13 +252,28 @@ function startSelectedGame() {
             0, // Play audio locally too
             0x030002 // Surround channel mask << 16 | Surround channel count
             ).then(function (ret) {
-                sendMessage('startRequest', [target, streamWidth, streamHeight, frameRate, bitrate.toString(), api.serverMajorVersion.toString()]);
+                sendMessage('startRequest', [target, streamWidth, streamHeight, frameRate, bitrate.toString(), api.serverMajorVersion.toString(), packetSize.toString()]);
             });
     });
     console.log('finished startSelectedGame.');
     playGameMode();
 }
 
+// Pick the video packet size for a host. Chrome apps can't probe the path MTU,
+// so on private networks assume a standard 1500 byte Ethernet MTU and use the
+// 1392 byte payload other Moonlight clients use there, which leaves room for
+// the IP (20), UDP (8), RTP (12) and video packet (16) headers with margin.
+// Stay conservative elsewhere, where VPNs and tunnels shrink the MTU.
+function getPacketSize(host) {
+    if (packetSizeOverride != null) {
+        return packetSizeOverride;
+    }
+    if (/^(10\.|192\.168\.|172\.(1[6-9]|2[0-9]|3[01])\.)/.test(host)) {
+        return 1392;
+    }
+    return 1024;
+}
+
 function cancelReplaceApp() {
     showAppsMode();
     document.querySelector('#replaceAppDialog').close();
@@ -270,6 +288,7 @@ function continueReplaceApp() {
 
 function playGameMode() {
     console.log("entering play game mode");
+    qosResolutionAdviceShown = false;
     $(".mdl-layout__header").hide();
     $("#main-content").children().not("#listener").hide();
     $("#main-content").addClass("fullscreen");
@@ -395,6 +414,11 @@ function onWindowLoad(){
             $('#bitrateSlider')[0].MaterialSlider.change(previousValue.bitrate != null ? previousValue.bitrate : '15');
             updateBitrateField();
         });
+        chrome.storage.sync.get('packetSize', function(savedPacketSize) {
+            if (savedPacketSize.packetSize != null && !isNaN(parseInt(savedPacketSize.packetSize))) {
+                packetSizeOverride = parseInt(savedPacketSize.packetSize);
+            }
+        });
         // load the HTTP cert if we have one.
         chrome.storage.sync.get('cert', function(savedCert) {
             if (savedCert.cert != null) { // we have a saved cert
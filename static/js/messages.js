@@ -1,5 +1,6 @@
 var callbacks = {}
 var callbacks_ids = 1;
+var qosResolutionAdviceShown = false; // reset for each stream in playGameMode()
 
 var sendMessage = function(method, params) {
     return new Promise(function(resolve, reject) {
@@ -24,6 +25,19 @@ function handleMessage(msg) {
             api.refreshServerInfo().then(function (ret) {
                 showAppsMode();
             });
+        } else if(typeof msg.data === 'string' && msg.data.indexOf('qosLowerBitrate ') === 0) {
+            // the host only takes a bitrate at launch, so this applies to the next stream
+            var mbps = Math.floor(parseInt(msg.data.split(' ')[1]) / 1024);
+            snackbarLog('Connection is congested. Try a bitrate of ' + mbps + ' Mbps or lower');
+        } else if(typeof msg.data === 'string' && msg.data.indexOf('qosRaiseBitrate ') === 0) {
+            var mbps = Math.floor(parseInt(msg.data.split(' ')[1]) / 1024);
+            snackbarLog('Connection has recovered. A bitrate of ' + mbps + ' Mbps should work');
+        } else if(msg.data === 'qosLowerResolution') {
+            // this keeps firing while the stream sits at the bitrate floor, so only say it once
+            if(!qosResolutionAdviceShown) {
+                qosResolutionAdviceShown = true;
+                snackbarLog('Connection cannot sustain this resolution. Try a lower one');
+            }
         }
     }
 }
\ No newline at end of file
@@ -0,0 +1,108 @@
+// Host test for the hex codec used on the pairing path (see libgamestream/hex.c)
+
+#include "hex.h"
+#include "errors.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+#define MAX_LEN 300
+
+static void TestRoundTrip(void) {
+    unsigned char in[MAX_LEN], out[MAX_LEN];
+    char hex[MAX_LEN * 2 + 1];
+    int i, j;
+    
+    for (i = 0; i < 100000; i++) {
+        size_t len = rand() % MAX_LEN;
+        for (j = 0; j < (int)len; j++) {
+            in[j] = (unsigned char)rand();
+        }
+        
+        hex_encode(in, hex, len);
+        CHECK(strlen(hex) == len * 2);
+        CHECK(hex_decode(hex, out, len * 2) == GS_OK);
+        CHECK(memcmp(in, out, len) == 0);
+    }
+}
+
+static void TestCaseInsensitive(void) {
+    unsigned char in[MAX_LEN], lower[MAX_LEN], upper[MAX_LEN];
+    char hex[MAX_LEN * 2 + 1];
+    int i, j;
+    
+    for (i = 0; i < 10000; i++) {
+        size_t len = 1 + rand() % (MAX_LEN - 1);
+        for (j = 0; j < (int)len; j++) {
+            in[j] = (unsigned char)rand();
+        }
+        
+        hex_encode(in, hex, len);
+        CHECK(hex_decode(hex, lower, len * 2) == GS_OK);
+        
+        // Uppercase a random selection of the digits
+        for (j = 0; j < (int)len * 2; j++) {
+            if (rand() % 2) {
+                hex[j] = (char)toupper((unsigned char)hex[j]);
+            }
+        }
+        CHECK(hex_decode(hex, upper, len * 2) == GS_OK);
+        CHECK(memcmp(lower, upper, len) == 0);
+    }
+    
+    CHECK(hex_decode("ABCDEF", upper, 6) == GS_OK);
+    CHECK(hex_decode("abcdef", lower, 6) == GS_OK);
+    CHECK(memcmp(upper, lower, 3) == 0 && upper[0] == 0xAB && upper[2] == 0xEF);
+}
+
+static void TestRejectsBadInput(void) {
+    unsigned char out[MAX_LEN];
+    char hex[MAX_LEN * 2 + 1];
+    int c;
+    
+    CHECK(hex_decode("abc", out, 3) == GS_INVALID);
+    CHECK(hex_decode("0", out, 1) == GS_INVALID);
+    CHECK(hex_decode("", out, 0) == GS_OK);
+    
+    // Every non-hex character, in either half of a byte and anywhere in
+    // the string, must be caught
+    for (c = 0; c < 256; c++) {
+        if (isxdigit(c)) {
+            continue;
+        }
+        
+        memset(hex, '7', sizeof(hex) - 1);
+        hex[sizeof(hex) - 1] = 0;
+        hex[c % (sizeof(hex) - 1)] = (char)c;
+        CHECK(hex_decode(hex, out, sizeof(hex) - 1) == GS_INVALID);
+        
+        hex[c % (sizeof(hex) - 1)] = '7';
+        hex[sizeof(hex) - 2] = (char)c;
+        CHECK(hex_decode(hex, out, sizeof(hex) - 1) == GS_INVALID);
+        
+        hex[sizeof(hex) - 2] = '7';
+        hex[0] = (char)c;
+        CHECK(hex_decode(hex, out, sizeof(hex) - 1) == GS_INVALID);
+    }
+}
+
+int main(void) {
+    srand(1);
+    
+    TestRoundTrip();
+    TestCaseInsensitive();
+    TestRejectsBadInput();
+    
+    printf("hex_test: all checks passed\n");
+    return 0;
+}
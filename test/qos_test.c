@@ -0,0 +1,108 @@
+// Host test for the QoS controller's decision logic (see qos.c)
+
+#include "qos.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+// One second at 60 fps with the given number of lost frames
+static int Feed(PQOS_CONTROLLER qos, int framesLost) {
+    QOS_SAMPLE sample = { 1000, 60 - framesLost, framesLost, 4000, 1000 };
+    return QosUpdate(qos, &sample);
+}
+
+static void TestBacksOffAfterThreeCongestedWindows(void) {
+    QOS_CONTROLLER qos;
+    QosInit(&qos, 20000, 60);
+    
+    CHECK(Feed(&qos, 6) == QOS_HOLD);
+    CHECK(Feed(&qos, 6) == QOS_HOLD);
+    CHECK(Feed(&qos, 6) == QOS_LOWER_BITRATE);
+    CHECK(qos.bitrate == 14000);
+    
+    // A clean window resets the streak
+    CHECK(Feed(&qos, 6) == QOS_HOLD);
+    CHECK(Feed(&qos, 0) == QOS_HOLD);
+    CHECK(Feed(&qos, 6) == QOS_HOLD);
+    CHECK(Feed(&qos, 6) == QOS_HOLD);
+    CHECK(Feed(&qos, 6) == QOS_LOWER_BITRATE);
+    CHECK(qos.bitrate == 9800);
+}
+
+static void TestAdvisesLowerResolutionAtFloor(void) {
+    QOS_CONTROLLER qos;
+    int i, decision = QOS_HOLD;
+    QosInit(&qos, 20000, 60);
+    
+    // 20000 -> 14000 -> 9800 -> 6860 -> 5000 (25% floor)
+    for (i = 0; i < 4 * 3; i++) {
+        decision = Feed(&qos, 6);
+    }
+    CHECK(decision == QOS_LOWER_BITRATE);
+    CHECK(qos.bitrate == 5000);
+    
+    CHECK(Feed(&qos, 6) == QOS_HOLD);
+    CHECK(Feed(&qos, 6) == QOS_HOLD);
+    CHECK(Feed(&qos, 6) == QOS_LOWER_RESOLUTION);
+    CHECK(qos.bitrate == 5000);
+}
+
+static void TestRaisesAfterTenCleanWindows(void) {
+    QOS_CONTROLLER qos;
+    int i;
+    QosInit(&qos, 20000, 60);
+    
+    // Never above the starting bitrate
+    for (i = 0; i < 20; i++) {
+        CHECK(Feed(&qos, 0) == QOS_HOLD);
+    }
+    
+    for (i = 0; i < 3; i++) {
+        Feed(&qos, 6);
+    }
+    CHECK(qos.bitrate == 14000);
+    
+    for (i = 0; i < 9; i++) {
+        CHECK(Feed(&qos, 0) == QOS_HOLD);
+    }
+    CHECK(Feed(&qos, 0) == QOS_RAISE_BITRATE);
+    CHECK(qos.bitrate == 15400);
+}
+
+static void TestIgnoresJitterInLowFrameRateWindows(void) {
+    QOS_CONTROLLER qos;
+    int i;
+    QosInit(&qos, 20000, 60);
+    
+    // A host sending 20 fps into a 60 fps stream, with uneven pacing
+    for (i = 0; i < 20; i++) {
+        QOS_SAMPLE sample = { 1000, 20, 0, 4000, 33000 };
+        CHECK(QosUpdate(&qos, &sample) == QOS_HOLD);
+    }
+    CHECK(qos.bitrate == 20000);
+    
+    // The same jitter at the full frame rate is still congestion
+    for (i = 0; i < 3; i++) {
+        QOS_SAMPLE sample = { 1000, 60, 0, 4000, 33000 };
+        CHECK(QosUpdate(&qos, &sample) == (i < 2 ? QOS_HOLD : QOS_LOWER_BITRATE));
+    }
+    CHECK(qos.bitrate == 14000);
+}
+
+int main(void) {
+    TestBacksOffAfterThreeCongestedWindows();
+    TestAdvisesLowerResolutionAtFloor();
+    TestRaisesAfterTenCleanWindows();
+    TestIgnoresJitterInLowFrameRateWindows();
+    
+    printf("qos_test: all checks passed\n");
+    return 0;
+}
@@ -7,10 +7,34 @@
 
 #include <h264_stream.h>
 
+#include <math.h>
+
+#include "qos.h"
+
 #define INITIAL_DECODE_BUFFER_LEN 128 * 1024
 
+// IDR frames are assumed to be up to this many times the average frame size
+#define IDR_FRAME_SIZE_FACTOR 8
+
+// Returned by CheckFrameNum() for frames that can be dropped without recovery
+#define FRAME_NUM_DROP 1
+// Returned by CheckFrameNum() for frames dropped while an IDR frame is on its way
+#define FRAME_NUM_AWAIT_IDR 2
+
+// Frames to drop while waiting for a requested IDR frame before asking again,
+// in case the request or the IDR frame itself was lost
+#define IDR_REQUEST_RETRY_FRAMES 60
+
+// Length of a QoS sample window in seconds
+#define QOS_WINDOW_SECS 1.0
+
+#define MSG_QOS_LOWER_BITRATE "qosLowerBitrate"
+#define MSG_QOS_RAISE_BITRATE "qosRaiseBitrate"
+#define MSG_QOS_LOWER_RESOLUTION "qosLowerResolution"
+
 static unsigned char* s_DecodeBuffer;
 static unsigned int s_DecodeBufferLength;
+static unsigned int s_DecodeBufferGrowths;
 static int s_LastTextureType;
 static int s_LastTextureId;
 static int s_NextDecodeFrameNumber;
@@ -19,6 +43,30 @@ static unsigned char s_LastSps[256];
 static unsigned char s_LastPps[256];
 static unsigned int s_LastSpsLength;
 static unsigned int s_LastPpsLength;
+static h264_stream_t* s_SpsStream;
+static int s_Log2MaxFrameNum;
+static bool s_GapsInFrameNumAllowed;
+static int s_LastRefFrameNum;
+static bool s_WaitingForIdr;
+static int s_FramesAwaitingIdr;
+static int s_SkipPicturesBefore;
+static unsigned int s_IdrFramesRequested;
+static unsigned int s_IdrFramesAvoided;
+static bool s_DecoderReady;
+static unsigned int s_FramesDecoded;
+static QOS_CONTROLLER s_Qos;
+static QOS_SAMPLE s_QosSample;
+static PP_TimeTicks s_QosWindowStart;
+static PP_TimeTicks s_QosWindowDecodeTime;
+static PP_TimeTicks s_LastFrameArrival;
+static double s_QosGapSum;
+static double s_QosGapSquareSum;
+static int s_QosGaps;
+static PP_TimeTicks s_DecodeTime;
+static unsigned int s_FramesPainted;
+static unsigned int s_FramesSkipped;
+static PP_TimeTicks s_SwapStartTime;
+static PP_TimeTicks s_SwapTime;
 
 #define assertNoGLError() assert(!g_Instance->m_GlesApi->GetError(g_Instance->m_Graphics3D->pp_resource()))
 
@@ -63,24 +111,85 @@ static const char k_FragmentShaderExternal[] =
       "}";
     
 void MoonlightInstance::DidChangeFocus(bool got_focus) {
-    // Request an IDR frame to dump the frame queue that may have
-    // built up from the GL pipeline being stalled.
+    // Dump the frame queue that may have built up from the GL
+    // pipeline being stalled.
     if (got_focus) {
-        g_Instance->m_RequestIdrFrame = true;
+        g_Instance->SkipStalledPictures();
     }
 }
 
+void MoonlightInstance::SkipStalledPictures() {
+    // Everything already submitted to the decoder is stale, so don't
+    // paint any of it. The decoder's references are still intact, so
+    // unlike an IDR frame this costs no extra bandwidth.
+    s_SkipPicturesBefore = s_NextDecodeFrameNumber;
+    
+    // This runs on the main thread while the decoder thread also counts
+    __atomic_fetch_add(&s_IdrFramesAvoided, 1, __ATOMIC_RELAXED);
+}
+
+// Fits the stream into the surface, centered, keeping its aspect ratio.
+// glClear() ignores the viewport, so the bars are cleared to black.
+static void SetLetterboxViewport(int surfaceWidth, int surfaceHeight, int streamWidth, int streamHeight) {
+    if (streamWidth <= 0 || streamHeight <= 0) {
+        glViewport(0, 0, surfaceWidth, surfaceHeight);
+        return;
+    }
+    
+    int width = surfaceWidth;
+    int height = surfaceWidth * streamHeight / streamWidth;
+    
+    if (height > surfaceHeight) {
+        height = surfaceHeight;
+        width = surfaceHeight * streamWidth / streamHeight;
+    }
+    
+    glViewport((surfaceWidth - width) / 2, (surfaceHeight - height) / 2, width, height);
+}
+
+void MoonlightInstance::DidChangeView(const pp::View& view) {
+    float scale = view.GetDeviceScale();
+    
+    // Render at the plugin's size in device pixels and let the GPU do
+    // the scaling, rather than having the browser stretch the surface.
+    m_ViewWidth = (int)(view.GetRect().width() * scale);
+    m_ViewHeight = (int)(view.GetRect().height() * scale);
+    m_ViewChanged = true;
+    
+    // The buffers can't be resized while a swap is in flight, so
+    // PaintFinished() picks up the change in that case.
+    if (!m_IsPainting) {
+        ResizeRenderingSurface();
+    }
+}
+
+void MoonlightInstance::ResizeRenderingSurface() {
+    m_ViewChanged = false;
+    
+    if (m_Graphics3D.is_null() || m_ViewWidth <= 0 || m_ViewHeight <= 0) {
+        return;
+    }
+    
+    // Only the surface changes; the stream and decoder keep going
+    m_Graphics3D.ResizeBuffers(m_ViewWidth, m_ViewHeight);
+    SetLetterboxViewport(m_ViewWidth, m_ViewHeight, m_StreamConfig.width, m_StreamConfig.height);
+}
+
 void MoonlightInstance::InitializeRenderingSurface(int width, int height) {
     if (!glInitializePPAPI(pp::Module::Get()->get_browser_interface())) {
         return;
     }
     
+    // Start at the current view size if we know it
+    int surfaceWidth = m_ViewWidth > 0 ? m_ViewWidth : width;
+    int surfaceHeight = m_ViewHeight > 0 ? m_ViewHeight : height;
+    
     int32_t contextAttributes[] = {
         PP_GRAPHICS3DATTRIB_BLUE_SIZE, 8,
         PP_GRAPHICS3DATTRIB_GREEN_SIZE, 8,
         PP_GRAPHICS3DATTRIB_RED_SIZE, 8,
-        PP_GRAPHICS3DATTRIB_WIDTH, width,
-        PP_GRAPHICS3DATTRIB_HEIGHT, height,
+        PP_GRAPHICS3DATTRIB_WIDTH, surfaceWidth,
+        PP_GRAPHICS3DATTRIB_HEIGHT, surfaceHeight,
         PP_GRAPHICS3DATTRIB_NONE
     };
     g_Instance->m_Graphics3D = pp::Graphics3D(this, contextAttributes);
@@ -102,7 +211,7 @@ void MoonlightInstance::InitializeRenderingSurface(int width, int height) {
     
     glDisable(GL_DITHER);
     
-    glViewport(0, 0, width, height);
+    SetLetterboxViewport(surfaceWidth, surfaceHeight, width, height);
     
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT);
@@ -124,32 +233,126 @@ void MoonlightInstance::InitializeRenderingSurface(int width, int height) {
                  GL_STATIC_DRAW);
     assertNoGLError();
     
+    // Build every program now so the first frame of each texture
+    // target doesn't stall on a shader compile. The external OES one
+    // fails to build where the extension is missing, but the decoder
+    // won't hand us those textures there either.
+    g_Instance->m_Texture2DShader = CreateProgram(k_VertexShader, k_FragmentShader2D);
+    g_Instance->m_RectangleArbShader = CreateProgram(k_VertexShader, k_FragmentShaderRectangle);
+    g_Instance->m_ExternalOesShader = CreateProgram(k_VertexShader, k_FragmentShaderExternal);
+    glActiveTexture(GL_TEXTURE0);
+    
     g_Instance->m_Graphics3D.SwapBuffers(pp::BlockUntilComplete());
 }
 
+// Maps the negotiated video format to a decoder profile. Pepper's
+// VideoDecoder only offers H.264, VP8 and VP9 profiles, so HEVC can't
+// be decoded here even if the host offers it.
+static bool GetVideoProfile(int videoFormat, PP_VideoProfile* profile) {
+#ifdef VIDEO_FORMAT_H265
+    if (videoFormat == VIDEO_FORMAT_H265) {
+        return false;
+    }
+#endif
+    
+    *profile = PP_VIDEOPROFILE_H264HIGH;
+    return true;
+}
+
 void MoonlightInstance::VidDecSetup(int videoFormat, int width, int height, int redrawRate, void* context, int drFlags) {
-    g_Instance->m_VideoDecoder = new pp::VideoDecoder(g_Instance);
+    PP_VideoProfile profile = PP_VIDEOPROFILE_H264HIGH;
+    int32_t err;
     
+    g_Instance->m_VideoDecoder = NULL;
+    
+    // Size the decode buffer for the largest frame we expect at this
+    // bitrate (in Kbps) and frame rate so it rarely has to grow mid-stream
     s_DecodeBufferLength = INITIAL_DECODE_BUFFER_LEN;
+    if (redrawRate > 0) {
+        unsigned int expectedLength = (unsigned int)g_Instance->m_StreamConfig.bitrate * 1024 / 8 /
+                                      redrawRate * IDR_FRAME_SIZE_FACTOR;
+        if (expectedLength > s_DecodeBufferLength) {
+            s_DecodeBufferLength = expectedLength;
+        }
+    }
     s_DecodeBuffer = (unsigned char *)malloc(s_DecodeBufferLength);
+    s_DecodeBufferGrowths = 0;
     s_LastTextureType = 0;
     s_LastTextureId = 0;
     s_LastSpsLength = 0;
     s_LastPpsLength = 0;
+    s_SpsStream = h264_new();
+    s_Log2MaxFrameNum = 4;
+    s_GapsInFrameNumAllowed = false;
+    s_LastRefFrameNum = -1;
+    s_WaitingForIdr = false;
+    s_FramesAwaitingIdr = 0;
+    s_SkipPicturesBefore = 0;
+    s_IdrFramesRequested = 0;
+    s_IdrFramesAvoided = 0;
+    s_FramesDecoded = 0;
+    QosInit(&s_Qos, g_Instance->m_StreamConfig.bitrate, redrawRate);
+    memset(&s_QosSample, 0, sizeof(s_QosSample));
+    s_QosWindowStart = 0;
+    s_QosWindowDecodeTime = 0;
+    s_LastFrameArrival = 0;
+    s_QosGapSum = 0;
+    s_QosGapSquareSum = 0;
+    s_QosGaps = 0;
+    s_DecodeTime = 0;
+    s_FramesPainted = 0;
+    s_FramesSkipped = 0;
+    s_SwapTime = 0;
     s_NextDecodeFrameNumber = 0;
     s_LastDisplayFrameNumber = 0;
     
-    g_Instance->m_VideoDecoder->Initialize(g_Instance->m_Graphics3D,
-                                           PP_VIDEOPROFILE_H264HIGH,
-                                           PP_HARDWAREACCELERATION_ONLY,
-                                           0,
-                                           pp::BlockUntilComplete());
+    s_DecoderReady = GetVideoProfile(videoFormat, &profile);
+    if (!s_DecoderReady) {
+        // Don't create a decoder we can't feed; every decode unit will be discarded
+        g_Instance->PostMessage(pp::Var("Unsupported video format: " + std::to_string(videoFormat)));
+        return;
+    }
+    
+    // Every SPS is rewritten with this stream, so there's nothing we can decode without it
+    if (s_SpsStream == NULL) {
+        g_Instance->PostMessage(pp::Var("Failed to allocate the H.264 parser"));
+        s_DecoderReady = false;
+        return;
+    }
+    
+    g_Instance->m_VideoDecoder = new pp::VideoDecoder(g_Instance);
+    err = g_Instance->m_VideoDecoder->Initialize(g_Instance->m_Graphics3D,
+                                                 profile,
+                                                 PP_HARDWAREACCELERATION_ONLY,
+                                                 0,
+                                                 pp::BlockUntilComplete());
+    if (err != PP_OK) {
+        // No hardware decoder for this profile, so let the browser
+        // fall back to its own multi-threaded software decoder.
+        g_Instance->PostMessage(pp::Var("Hardware video decoding unavailable (error " + std::to_string(err) +
+                                        "); falling back to software decoding"));
+        delete g_Instance->m_VideoDecoder;
+        g_Instance->m_VideoDecoder = new pp::VideoDecoder(g_Instance);
+        err = g_Instance->m_VideoDecoder->Initialize(g_Instance->m_Graphics3D,
+                                                     profile,
+                                                     PP_HARDWAREACCELERATION_WITHFALLBACK,
+                                                     0,
+                                                     pp::BlockUntilComplete());
+        if (err != PP_OK) {
+            g_Instance->PostMessage(pp::Var("Failed to initialize video decoder: " + std::to_string(err)));
+            s_DecoderReady = false;
+        }
+    }
     
     pp::Module::Get()->core()->CallOnMainThread(0,
         g_Instance->m_CallbackFactory.NewCallback(&MoonlightInstance::DispatchGetPicture));
 }
 
 void MoonlightInstance::DispatchGetPicture(uint32_t unused) {
+    if (!s_DecoderReady) {
+        return;
+    }
+    
     // Queue the initial GetPicture callback on the main thread
     g_Instance->m_VideoDecoder->GetPicture(
         g_Instance->m_CallbackFactory.NewCallbackWithOutput(&MoonlightInstance::PictureReady));
@@ -157,10 +360,31 @@ void MoonlightInstance::DispatchGetPicture(uint32_t unused) {
 
 void MoonlightInstance::VidDecCleanup(void) {
     free(s_DecodeBuffer);
+    h264_free(s_SpsStream);
+    s_SpsStream = NULL;
+    
+    g_Instance->PostMessage(pp::Var("Video decoder requested " + std::to_string(s_IdrFramesRequested) +
+                                    " IDR frames and avoided " + std::to_string(s_IdrFramesAvoided)));
+    if (s_FramesDecoded != 0) {
+        g_Instance->PostMessage(pp::Var("Video decoder took " +
+                                        std::to_string((int)(s_DecodeTime * 1000000 / s_FramesDecoded)) +
+                                        " us per frame over " + std::to_string(s_FramesDecoded) + " frames"));
+    }
+    g_Instance->PostMessage(pp::Var("Decode buffer grew " + std::to_string(s_DecodeBufferGrowths) +
+                                    " times to " + std::to_string(s_DecodeBufferLength) + " bytes"));
+    if (s_FramesPainted != 0) {
+        g_Instance->PostMessage(pp::Var("Painted " + std::to_string(s_FramesPainted) + " frames and skipped " +
+                                        std::to_string(s_FramesSkipped) + "; waited " +
+                                        std::to_string((int)(s_SwapTime * 1000000 / s_FramesPainted)) +
+                                        " us per frame for buffer swaps"));
+    }
     
-    // Flush and delete the decoder
-    g_Instance->m_VideoDecoder->Flush(pp::BlockUntilComplete());
-    delete g_Instance->m_VideoDecoder;
+    // Flush and delete the decoder, if we created one
+    if (g_Instance->m_VideoDecoder != NULL) {
+        g_Instance->m_VideoDecoder->Flush(pp::BlockUntilComplete());
+        delete g_Instance->m_VideoDecoder;
+        g_Instance->m_VideoDecoder = NULL;
+    }
     
     if (g_Instance->m_Texture2DShader.program) {
         glDeleteProgram(g_Instance->m_Texture2DShader.program);
@@ -176,12 +400,36 @@ void MoonlightInstance::VidDecCleanup(void) {
     }
 }
 
+// Returns the type of the first NALU in the buffer and its offset
+// after the start code, or -1 if there's no start code.
+static int GetFirstNaluType(unsigned char* data, int length, int* naluStart) {
+    int naluEnd;
+    
+    // Only the start code and NALU header are needed, so don't
+    // scan any further into the buffer than that.
+    if (find_nal_units(data, length < 8 ? length : 8, naluStart, &naluEnd, 1) == 0 ||
+        *naluStart >= naluEnd) {
+        return -1;
+    }
+    
+    return data[*naluStart] & 0x1F;
+}
+
 static void ProcessSpsNalu(unsigned char* data, int length) {
     const char naluHeader[] = {0x00, 0x00, 0x00, 0x01};
-    h264_stream_t* stream = h264_new();
+    unsigned char rbspScratch[sizeof(s_LastSps)];
+    h264_stream_t* stream = s_SpsStream;
+    
+    // The stream is reused for every SPS, so start from a clean slate
+    h264_reset(stream);
+    
+    // Read the old NALU (without its start code)
+    read_nal_unit(stream, data, length);
     
-    // Read the old NALU
-    read_nal_unit(stream, &data[sizeof(naluHeader)], length-sizeof(naluHeader));
+    // Remember the frame_num width for slice header parsing, and whether
+    // the encoder may legitimately skip frame_num values
+    s_Log2MaxFrameNum = stream->sps->log2_max_frame_num_minus4 + 4;
+    s_GapsInFrameNumAllowed = stream->sps->gaps_in_frame_num_value_allowed_flag != 0;
     
     // Fixup the SPS to what OS X needs to use hardware acceleration
     stream->sps->num_ref_frames = 1;
@@ -191,57 +439,203 @@ static void ProcessSpsNalu(unsigned char* data, int length) {
     memcpy(s_LastSps, naluHeader, sizeof(naluHeader));
     
     // Copy the modified NALU data
-    s_LastSpsLength = sizeof(naluHeader) + write_nal_unit(stream,
-                                                          &s_LastSps[sizeof(naluHeader)],
-                                                          sizeof(s_LastSps)-sizeof(naluHeader));
+    s_LastSpsLength = sizeof(naluHeader) + write_nal_unit_with_scratch(stream,
+                                                                       &s_LastSps[sizeof(naluHeader)],
+                                                                       sizeof(s_LastSps)-sizeof(naluHeader),
+                                                                       rbspScratch,
+                                                                       sizeof(rbspScratch));
+}
+
+// Checks frame_num continuity of the frame starting with the given
+// slice NALU. Returns DR_OK to decode it, DR_NEED_IDR if a reference
+// frame has just been found lost (or an IDR frame we asked for is
+// overdue), FRAME_NUM_AWAIT_IDR for the frames after that until an IDR
+// frame arrives, or FRAME_NUM_DROP if the frame should be dropped but
+// the reference chain is still intact.
+static int CheckFrameNum(unsigned char* data, int length) {
+    slice_header_prefix_t sh;
+    
+    if (peek_slice_header(data, length, s_Log2MaxFrameNum, &sh) < 0) {
+        // Not enough to go on, so let the decoder deal with it
+        return DR_OK;
+    }
+    
+    if (sh.idr_pic_flag) {
+        s_LastRefFrameNum = sh.frame_num;
+        s_WaitingForIdr = false;
+        return DR_OK;
+    }
+    
+    if (s_WaitingForIdr) {
+        // Everything until the next IDR frame references the lost frame.
+        // It has already been requested once; each DR_NEED_IDR would
+        // send another request to the host, so only ask again if it's
+        // taking too long to show up.
+        if (++s_FramesAwaitingIdr >= IDR_REQUEST_RETRY_FRAMES) {
+            s_FramesAwaitingIdr = 0;
+            s_IdrFramesRequested++;
+            return DR_NEED_IDR;
+        }
+        return FRAME_NUM_AWAIT_IDR;
+    }
     
-    h264_free(stream);
+    if (s_LastRefFrameNum < 0) {
+        // We haven't seen an IDR frame yet to anchor frame_num
+        return DR_OK;
+    }
+    
+    // A missing first slice means this frame is incomplete. If nothing
+    // references it, dropping it is enough.
+    if (sh.first_mb_in_slice != 0) {
+        if (sh.nal_ref_idc == 0) {
+            return FRAME_NUM_DROP;
+        }
+        
+        s_WaitingForIdr = true;
+        s_FramesAwaitingIdr = 0;
+        s_IdrFramesRequested++;
+        return DR_NEED_IDR;
+    }
+    
+    // frame_num only advances after reference frames, so a gap means
+    // one of them never arrived. Lost non-reference frames leave no gap
+    // and need no recovery. If the SPS allows gaps, they tell us nothing.
+    if (!s_GapsInFrameNumAllowed &&
+        sh.frame_num != ((s_LastRefFrameNum + 1) & ((1 << s_Log2MaxFrameNum) - 1))) {
+        s_WaitingForIdr = true;
+        s_FramesAwaitingIdr = 0;
+        s_IdrFramesRequested++;
+        return DR_NEED_IDR;
+    }
+    
+    if (sh.nal_ref_idc != 0) {
+        s_LastRefFrameNum = sh.frame_num;
+    }
+    
+    return DR_OK;
+}
+
+// Accounts for a frame arriving at the given time and, once a window
+// has elapsed, runs the QoS controller over it and tells the page
+// about any change it recommends.
+static void UpdateQos(PP_TimeTicks now, bool lost) {
+    if (s_LastFrameArrival != 0) {
+        // Jitter is measured against the window's own mean inter-arrival
+        // time, so a host that simply sends fewer frames (static content,
+        // a game capped below the stream frame rate) doesn't look congested
+        double gap = now - s_LastFrameArrival;
+        s_QosGapSum += gap;
+        s_QosGapSquareSum += gap * gap;
+        s_QosGaps++;
+    }
+    s_LastFrameArrival = now;
+    
+    if (lost) {
+        s_QosSample.framesLost++;
+    }
+    else {
+        s_QosSample.framesReceived++;
+    }
+    
+    if (s_QosWindowStart == 0) {
+        s_QosWindowStart = now;
+        return;
+    }
+    if (now - s_QosWindowStart < QOS_WINDOW_SECS) {
+        return;
+    }
+    
+    s_QosSample.windowMs = (int)((now - s_QosWindowStart) * 1000);
+    if (s_QosGaps != 0) {
+        double meanGap = s_QosGapSum / s_QosGaps;
+        double variance = s_QosGapSquareSum / s_QosGaps - meanGap * meanGap;
+        s_QosSample.jitterUs = (int)(sqrt(variance > 0 ? variance : 0) * 1000000);
+    }
+    s_QosSample.decodeTimeUs = s_QosSample.framesReceived != 0 ?
+        (int)(s_QosWindowDecodeTime * 1000000 / s_QosSample.framesReceived) : 0;
+    
+    switch (QosUpdate(&s_Qos, &s_QosSample)) {
+        case QOS_LOWER_BITRATE:
+            g_Instance->PostMessage(pp::Var(std::string(MSG_QOS_LOWER_BITRATE " ") + std::to_string(s_Qos.bitrate)));
+            break;
+        case QOS_RAISE_BITRATE:
+            g_Instance->PostMessage(pp::Var(std::string(MSG_QOS_RAISE_BITRATE " ") + std::to_string(s_Qos.bitrate)));
+            break;
+        case QOS_LOWER_RESOLUTION:
+            g_Instance->PostMessage(pp::Var(MSG_QOS_LOWER_RESOLUTION));
+            break;
+    }
+    
+    memset(&s_QosSample, 0, sizeof(s_QosSample));
+    s_QosWindowStart = now;
+    s_QosWindowDecodeTime = 0;
+    s_QosGapSum = 0;
+    s_QosGapSquareSum = 0;
+    s_QosGaps = 0;
 }
 
 int MoonlightInstance::VidDecSubmitDecodeUnit(PDECODE_UNIT decodeUnit) {
     PLENTRY entry;
     unsigned int offset;
     unsigned int totalLength;
-    bool isSps = false;
-    bool isPps = false;
+    int naluStart;
+    int naluType;
     bool isIframe = false;
     
-    // Request an IDR frame if needed
-    if (g_Instance->m_RequestIdrFrame) {
-        g_Instance->m_RequestIdrFrame = false;
-        return DR_NEED_IDR;
+    // Discard everything if we have nothing to decode it with
+    if (!s_DecoderReady) {
+        return DR_OK;
     }
     
     // Look at the NALU type
-    if (decodeUnit->bufferList->length > 5) {
-        switch (decodeUnit->bufferList->data[4]) {
-            case 0x67:
-                isSps = true;
+    naluType = GetFirstNaluType((unsigned char*)decodeUnit->bufferList->data,
+                                decodeUnit->bufferList->length, &naluStart);
+    switch (naluType) {
+        case NAL_UNIT_TYPE_SPS:
+            // Store the SPS for later submission with the I-frame
+            assert(decodeUnit->bufferList->length == decodeUnit->fullLength);
+            assert(decodeUnit->fullLength < sizeof(s_LastSps));
+            ProcessSpsNalu((unsigned char*)&decodeUnit->bufferList->data[naluStart],
+                           decodeUnit->bufferList->length - naluStart);
+            
+            // Don't submit anything to the decoder yet
+            return DR_OK;
+            
+        case NAL_UNIT_TYPE_PPS:
+            // Store the PPS for later submission with the I-frame
+            assert(decodeUnit->bufferList->length == decodeUnit->fullLength);
+            assert(decodeUnit->fullLength < sizeof(s_LastPps));
+            s_LastPpsLength = decodeUnit->bufferList->length;
+            memcpy(s_LastPps, decodeUnit->bufferList->data, s_LastPpsLength);
+
+            // Don't submit anything to the decoder yet
+            return DR_OK;
+            
+        case NAL_UNIT_TYPE_CODED_SLICE_IDR:
+            isIframe = true;
+            break;
+    }
+    
+    if (naluType == NAL_UNIT_TYPE_CODED_SLICE_IDR || naluType == NAL_UNIT_TYPE_CODED_SLICE_NON_IDR) {
+        switch (CheckFrameNum((unsigned char*)&decodeUnit->bufferList->data[naluStart],
+                              decodeUnit->bufferList->length - naluStart)) {
+            case DR_OK:
+                break;
                 
-                // Store the SPS for later submission with the I-frame
-                assert(decodeUnit->bufferList->length == decodeUnit->fullLength);
-                assert(decodeUnit->fullLength < sizeof(s_LastSps));
-                ProcessSpsNalu((unsigned char*)decodeUnit->bufferList->data,
-                               decodeUnit->bufferList->length);
+            case DR_NEED_IDR:
+                UpdateQos(pp::Module::Get()->core()->GetTimeTicks(), true);
+                return DR_NEED_IDR;
                 
-                // Don't submit anything to the decoder yet
+            case FRAME_NUM_AWAIT_IDR:
+                // Drop this frame without asking for another IDR frame
+                UpdateQos(pp::Module::Get()->core()->GetTimeTicks(), true);
                 return DR_OK;
                 
-            case 0x68:
-                isPps = true;
-                
-                // Store the PPS for later submission with the I-frame
-                assert(decodeUnit->bufferList->length == decodeUnit->fullLength);
-                assert(decodeUnit->fullLength < sizeof(s_LastPps));
-                s_LastPpsLength = decodeUnit->bufferList->length;
-                memcpy(s_LastPps, decodeUnit->bufferList->data, s_LastPpsLength);
-
-                // Don't submit anything to the decoder yet
+            case FRAME_NUM_DROP:
+                // Drop this frame but keep decoding the ones after it
+                __atomic_fetch_add(&s_IdrFramesAvoided, 1, __ATOMIC_RELAXED);
+                UpdateQos(pp::Module::Get()->core()->GetTimeTicks(), true);
                 return DR_OK;
-                
-            case 0x65:
-                isIframe = true;
-                break;
         }
     }
     
@@ -254,9 +648,14 @@ int MoonlightInstance::VidDecSubmitDecodeUnit(PDECODE_UNIT decodeUnit) {
     
     // Resize the decode buffer if needed
     if (totalLength > s_DecodeBufferLength) {
+        // Grow geometrically so a run of slightly larger frames
+        // doesn't reallocate on each one
+        while (s_DecodeBufferLength < totalLength) {
+            s_DecodeBufferLength *= 2;
+        }
         free(s_DecodeBuffer);
-        s_DecodeBufferLength = totalLength;
         s_DecodeBuffer = (unsigned char *)malloc(s_DecodeBufferLength);
+        s_DecodeBufferGrowths++;
     }
     
     if (isIframe) {
@@ -279,7 +678,14 @@ int MoonlightInstance::VidDecSubmitDecodeUnit(PDECODE_UNIT decodeUnit) {
     }
     
     // Start the decoding
+    PP_TimeTicks start = pp::Module::Get()->core()->GetTimeTicks();
     g_Instance->m_VideoDecoder->Decode(s_NextDecodeFrameNumber++, offset, s_DecodeBuffer, pp::BlockUntilComplete());
+    PP_TimeTicks elapsed = pp::Module::Get()->core()->GetTimeTicks() - start;
+    s_DecodeTime += elapsed;
+    s_QosWindowDecodeTime += elapsed;
+    s_FramesDecoded++;
+    
+    UpdateQos(start, false);
     
     return DR_OK;
 }
@@ -300,12 +706,25 @@ Shader MoonlightInstance::CreateProgram(const char* vertexShader, const char* fr
     CreateShader(shader.program, GL_VERTEX_SHADER, vertexShader, strlen(vertexShader));
     CreateShader(shader.program, GL_FRAGMENT_SHADER, fragmentShader, strlen(fragmentShader));
     glLinkProgram(shader.program);
+    
+    GLint linked = GL_FALSE;
+    glGetProgramiv(shader.program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        char log[512] = "";
+        glGetProgramInfoLog(shader.program, sizeof(log), NULL, log);
+        fprintf(stderr, "Unable to link shader program: %s\n", log);
+        glDeleteProgram(shader.program);
+        shader.program = 0;
+        return shader;
+    }
+    
     glUseProgram(shader.program);
     
     glUniform1i(glGetUniformLocation(shader.program, "s_texture"), 0);
     assertNoGLError();
     
     shader.texcoord_scale_location = glGetUniformLocation(shader.program, "v_scale");
+    SetTexcoordScale(&shader, 1.0, 1.0);
     
     GLint pos_location = glGetAttribLocation(shader.program, "a_position");
     GLint tc_location = glGetAttribLocation(shader.program, "a_texCoord");
@@ -321,6 +740,15 @@ Shader MoonlightInstance::CreateProgram(const char* vertexShader, const char* fr
     return shader;
 }
 
+// Must be called with the shader's program in use
+void MoonlightInstance::SetTexcoordScale(Shader* shader, GLfloat x, GLfloat y) {
+    if (shader->texcoord_scale_x != x || shader->texcoord_scale_y != y) {
+        glUniform2f(shader->texcoord_scale_location, x, y);
+        shader->texcoord_scale_x = x;
+        shader->texcoord_scale_y = y;
+    }
+}
+
 void MoonlightInstance::PaintPicture(void) {
     m_IsPainting = true;
     
@@ -330,6 +758,7 @@ void MoonlightInstance::PaintPicture(void) {
         picture = m_PendingPictureQueue.front();
         m_PendingPictureQueue.pop();
         g_Instance->m_VideoDecoder->RecyclePicture(picture);
+        s_FramesSkipped++;
     }
     
     picture = m_PendingPictureQueue.front();
@@ -342,42 +771,48 @@ void MoonlightInstance::PaintPicture(void) {
         return;
     }
     
+    Shader* shader;
+    switch (picture.texture_target) {
+        case GL_TEXTURE_2D:
+            shader = &g_Instance->m_Texture2DShader;
+            break;
+        case GL_TEXTURE_RECTANGLE_ARB:
+            shader = &g_Instance->m_RectangleArbShader;
+            break;
+        case GL_TEXTURE_EXTERNAL_OES:
+            shader = &g_Instance->m_ExternalOesShader;
+            break;
+        default:
+            shader = NULL;
+            break;
+    }
+    
+    // Recycle pictures we have no working program for
+    if (shader == NULL || !shader->program) {
+        g_Instance->m_VideoDecoder->RecyclePicture(picture);
+        m_PendingPictureQueue.pop();
+        m_IsPainting = false;
+        return;
+    }
+    
     // Calling glClear() once per frame is recommended for modern
     // GPUs which use it for state tracking hints.
     glClear(GL_COLOR_BUFFER_BIT);
     
     int originalTextureTarget = s_LastTextureType;
     
-    // Only make these state changes if we've changed from the last texture type
+    // Only switch programs if we've changed from the last texture type
     if (picture.texture_target != s_LastTextureType) {
-        if (picture.texture_target == GL_TEXTURE_2D) {
-            if (!g_Instance->m_Texture2DShader.program) {
-                g_Instance->m_Texture2DShader = CreateProgram(k_VertexShader, k_FragmentShader2D);
-            }
-            glUseProgram(g_Instance->m_Texture2DShader.program);
-            glUniform2f(g_Instance->m_Texture2DShader.texcoord_scale_location, 1.0, 1.0);
-        }
-        else if (picture.texture_target == GL_TEXTURE_RECTANGLE_ARB) {
-            if (!g_Instance->m_RectangleArbShader.program) {
-                g_Instance->m_RectangleArbShader = CreateProgram(k_VertexShader, k_FragmentShaderRectangle);
-            }
-            glUseProgram(g_Instance->m_RectangleArbShader.program);
-            glUniform2f(g_Instance->m_RectangleArbShader.texcoord_scale_location,
-                        picture.texture_size.width, picture.texture_size.height);
-        }
-        else if (picture.texture_target == GL_TEXTURE_EXTERNAL_OES) {
-            if (!g_Instance->m_ExternalOesShader.program) {
-                g_Instance->m_ExternalOesShader = CreateProgram(k_VertexShader, k_FragmentShaderExternal);
-            }
-            glUseProgram(g_Instance->m_ExternalOesShader.program);
-            glUniform2f(g_Instance->m_ExternalOesShader.texcoord_scale_location, 1.0, 1.0);
-        }
-
-        glActiveTexture(GL_TEXTURE0);
-
+        glUseProgram(shader->program);
         s_LastTextureType = picture.texture_target;
     }
     
+    // Rectangle textures use unnormalized coordinates. This is a no-op
+    // unless the texture size changed.
+    if (picture.texture_target == GL_TEXTURE_RECTANGLE_ARB) {
+        SetTexcoordScale(shader, picture.texture_size.width, picture.texture_size.height);
+    }
+    
     // Only rebind our texture if we've changed since last time
     if (picture.texture_id != s_LastTextureId || picture.texture_target != originalTextureTarget) {
         glBindTexture(picture.texture_target, picture.texture_id);
@@ -388,6 +823,7 @@ void MoonlightInstance::PaintPicture(void) {
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
     
     // Swap buffers
+    s_SwapStartTime = pp::Module::Get()->core()->GetTimeTicks();
     g_Instance->m_Graphics3D.SwapBuffers(
         g_Instance->m_CallbackFactory.NewCallback(&MoonlightInstance::PaintFinished));
 }
@@ -395,10 +831,19 @@ void MoonlightInstance::PaintPicture(void) {
 void MoonlightInstance::PaintFinished(int32_t result) {
     m_IsPainting = false;
     
+    // Time spent waiting here is time the GPU kept the previous frame busy
+    s_SwapTime += pp::Module::Get()->core()->GetTimeTicks() - s_SwapStartTime;
+    s_FramesPainted++;
+    
     // Recycle the picture now that it's been painted
     g_Instance->m_VideoDecoder->RecyclePicture(m_PendingPictureQueue.front());
     m_PendingPictureQueue.pop();
     
+    // Apply any view change that arrived mid-swap
+    if (m_ViewChanged) {
+        ResizeRenderingSurface();
+    }
+    
     // Keep painting if we still have frames
     if (!m_PendingPictureQueue.empty()) {
         PaintPicture();
@@ -406,12 +851,15 @@ void MoonlightInstance::PaintFinished(int32_t result) {
 }
 
 void MoonlightInstance::PictureReady(int32_t result, PP_VideoPicture picture) {
-    if (result == PP_ERROR_ABORTED) {
+    // Aborted during cleanup, or the decoder failed entirely
+    if (result != PP_OK) {
         return;
     }
     
     // Ensure we only push newer frames onto the display queue
-    if (picture.decode_id > s_LastDisplayFrameNumber) {
+    // and skip those queued up while the GL pipeline was stalled
+    if (picture.decode_id > s_LastDisplayFrameNumber &&
+        (int)picture.decode_id >= s_SkipPicturesBefore) {
         m_PendingPictureQueue.push(picture);
         s_LastDisplayFrameNumber = picture.decode_id;
     }